@@ -0,0 +1,138 @@
+// Memory objects for shared anonymous mappings.
+//
+// A MAP_SHARED|MAP_ANONYMOUS VMA points at a struct anon,
+// which holds the pages of the mapping by page index, so that
+// a page first touched after fork() is still the same page in
+// the parent and the child. Pages are allocated zero-filled on
+// the first fault, and the object holds one reference to each;
+// every mapping of a page holds another. Each VMA using the
+// object holds a reference to it, and the last anonput() frees
+// its pages. A System V shared memory segment (shm.c) is an
+// object with one more reference, held by the segment table.
+//
+// Private anonymous VMAs need no object: a fault just maps a
+// fresh zero page, and fork() shares them copy-on-write.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "defs.h"
+
+#define PAGESPERPAGE (PGSIZE / sizeof(char *))
+
+struct anon {
+  struct spinlock lock;
+  int ref;        // VMAs using the object
+  int npages;     // size of the object, in pages
+  int order;      // pages is a 2^order page block
+  char **pages;   // pages[i] is page i, or 0 if not touched yet
+};
+
+struct kmem_cache *anoncache;
+
+static void
+anonctor(void *o)
+{
+  initlock(&((struct anon *)o)->lock, "anon");
+}
+
+void
+anoninit(void)
+{
+  anoncache = kmem_cache_create("anon", sizeof(struct anon), anonctor);
+}
+
+// Return a new object of npages pages, none of them allocated
+// yet, with one reference. Returns 0 if out of memory.
+struct anon *
+anonalloc(int npages)
+{
+  struct anon *a;
+  int order = 0;
+
+  while ((PAGESPERPAGE << order) < npages)
+    order++;
+  if ((a = kmem_cache_alloc(anoncache)) == 0)
+    return 0;
+  if ((a->pages = kalloc_pages(order)) == 0)
+  {
+    kmem_cache_free(anoncache, a);
+    return 0;
+  }
+  memset(a->pages, 0, (uint64)PGSIZE << order);
+  a->ref = 1;
+  a->npages = npages;
+  a->order = order;
+  return a;
+}
+
+void
+anondup(struct anon *a)
+{
+  acquire(&a->lock);
+  a->ref++;
+  release(&a->lock);
+}
+
+// Drop a reference to a, freeing it and its pages with the
+// last. Returns the number of references left.
+int
+anonput(struct anon *a)
+{
+  int ref;
+
+  acquire(&a->lock);
+  if ((ref = --a->ref) > 0)
+  {
+    release(&a->lock);
+    return ref;
+  }
+  release(&a->lock);
+
+  for (int i = 0; i < a->npages; i++)
+    if (a->pages[i])
+      kput(a->pages[i]);
+  kfree_pages(a->pages, a->order);
+  kmem_cache_free(anoncache, a);
+  return 0;
+}
+
+// The number of references to a.
+int
+anonref(struct anon *a)
+{
+  int ref;
+
+  acquire(&a->lock);
+  ref = a->ref;
+  release(&a->lock);
+  return ref;
+}
+
+// Return page i of a, allocating a zeroed one if it has not
+// been touched yet, with a new reference for the caller to
+// map. Returns 0 if out of memory or i is out of range.
+char *
+anonpage(struct anon *a, int i)
+{
+  char *pa;
+
+  if (i < 0 || i >= a->npages)
+    return 0;
+  acquire(&a->lock);
+  if ((pa = a->pages[i]) == 0)
+  {
+    // kalloc_zeroed() does not sleep.
+    if ((pa = kalloc_zeroed()) == 0)
+    {
+      release(&a->lock);
+      return 0;
+    }
+    a->pages[i] = pa;
+  }
+  incref(pa);
+  release(&a->lock);
+  return pa;
+}
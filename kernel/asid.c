@@ -0,0 +1,109 @@
+// Address-space identifiers.
+//
+// satp tags each process's user page table with an ASID, so
+// the TLB can keep its entries when the trampoline switches
+// between it and the kernel page table (ASID 0), rather than
+// being flushed on every trap and every return to user space.
+//
+// ASIDs are handed out in generations: p->asid holds the
+// generation above the ASID bits. When a generation runs out
+// of ASIDs the next one starts, and each hart flushes its whole
+// TLB before it next returns to user space; a process holding
+// an ASID of an older generation gets a new one at that point.
+// So an ASID names only one page table in any TLB that has
+// been flushed since its generation began.
+//
+// Entries for a process's page table are kept up to date by:
+//  - uvmflushva() of each address whose PTE the process
+//    changes or removes while it runs (uvmunmap(), cowfault(),
+//    uvmprotect(), ...), which only reaches this hart's TLB;
+//  - flushing its ASID on a hart it moves to, which may hold
+//    entries from before changes made on another hart;
+//  - asidforget() when its page table changes while it is not
+//    running (reclaim) or is replaced (exec): the next return
+//    to user space takes a new ASID, which no TLB has entries
+//    for.
+//
+// A hart without ASIDs gets -1 from asidget(), and the TLB is
+// flushed on every switch of page table, as before.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+struct {
+  struct spinlock lock;
+  uint64 gen;      // current generation, a multiple of nasid
+  uint64 next;     // next ASID of this generation to hand out
+} asids;
+
+static uint64 nasid;   // ASIDs the harts implement; 0 is the kernel's
+
+// Find out how many ASID bits the hart implements: the ASID
+// field of satp keeps only those. Called on hart 0 after
+// kvminithart().
+void
+asidinit(void)
+{
+  uint64 satp = r_satp();
+
+  initlock(&asids.lock, "asid");
+  w_satp(satp | SATP_ASID_MASK);
+  nasid = ((r_satp() & SATP_ASID_MASK) >> SATP_ASID_SHIFT) + 1;
+  w_satp(satp);
+  sfence_vma();
+
+  asids.gen = nasid;
+  asids.next = 1;
+}
+
+// Return the ASID for running p's user page table on this
+// hart, flushing the TLB entries that could be stale for it,
+// or -1 if there are no ASIDs and the TLB must be flushed
+// whenever the page table changes. Interrupts are off.
+int
+asidget(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  int id = cpuid();
+
+  if (nasid <= 1)
+    return -1;
+
+  acquire(&asids.lock);
+  if (p->asid < asids.gen)
+  {
+    if (asids.next == nasid)
+    {
+      asids.gen += nasid;
+      asids.next = 1;
+    }
+    p->asid = asids.gen | asids.next++;
+    p->asidcpu = id;
+  }
+  if (c->asidgen != asids.gen)
+  {
+    sfence_vma();
+    c->asidgen = asids.gen;
+  }
+  else if (p->asidcpu != id)
+  {
+    sfence_vma_asid(p->asid & (nasid - 1));
+  }
+  p->asidcpu = id;
+  release(&asids.lock);
+
+  return p->asid & (nasid - 1);
+}
+
+// Drop p's ASID, and with it every TLB entry for its user
+// page table. p is not running.
+void
+asidforget(struct proc *p)
+{
+  p->asid = 0;
+}
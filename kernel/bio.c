@@ -136,6 +136,28 @@ brelse(struct buf *b)
   release(&bcache.lock);
 }
 
+// Return 1 if any of the n blocks from blockno on dev
+// has a buffer in the cache. Its contents may be newer
+// than the disk's, e.g. if it is waiting in the log, so
+// the blocks must not be read from the disk directly.
+int
+bcached(uint dev, uint blockno, uint n)
+{
+  struct buf *b;
+  int found = 0;
+
+  acquire(&bcache.lock);
+  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+    if(b->dev == dev && b->blockno >= blockno && b->blockno < blockno + n &&
+       (b->valid || b->refcnt > 0)){
+      found = 1;
+      break;
+    }
+  }
+  release(&bcache.lock);
+  return found;
+}
+
 void
 bpin(struct buf *b) {
   acquire(&bcache.lock);
@@ -1,9 +1,12 @@
+struct anon;
 struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
 struct pipe;
 struct proc;
+struct run;
 struct spinlock;
 struct sleeplock;
 struct stat;
@@ -11,6 +14,19 @@ struct superblock;
 struct pstat;
 struct vma;
 
+// anon.c
+void            anoninit(void);
+struct anon*    anonalloc(int);
+void            anondup(struct anon*);
+int             anonput(struct anon*);
+int             anonref(struct anon*);
+char*           anonpage(struct anon*, int);
+
+// asid.c
+void            asidinit(void);
+int             asidget(struct proc*);
+void            asidforget(struct proc*);
+
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
@@ -18,6 +34,7 @@ void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bcached(uint, uint, uint);
 
 // console.c
 void            consoleinit(void);
@@ -26,6 +43,12 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             execproc(struct proc*, char*, char**);
+
+// faultstat.c
+void            faultstatinit(void);
+void            faultcount(struct proc*, int, int, uint64);
+int             faultinfo(int, uint64);
 
 // file.c
 struct file*    filealloc(void);
@@ -52,6 +75,7 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+int             readi_pages(struct inode*, uint, char**, int);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
@@ -63,10 +87,18 @@ void            ramdiskrw(struct buf*);
 
 // kalloc.c
 void*           kalloc(void);
+void*           kalloc_zeroed(void);
+void*           kalloc_pages(int);
+void            kfree_pages(void *, int);
+void            kzero_idle(void);
+int             kfreepages(void);
 void            kfree(void *);
 void            kinit(void);
+void            kput(void *);
+void            kbatch_put(struct run **, void *);
+void            kbatch_free(struct run *);
 void		incref(void*);
-void		decref(void*);
+uint		decref(void*);
 uint		getref(void*);
 
 // log.c
@@ -76,11 +108,39 @@ void            begin_op(void);
 void            end_op(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
 int             pipewrite(struct pipe*, uint64, int);
 
+// pagecache.c
+void            pcacheinit(void);
+char*           pcache_get(uint, uint, uint);
+int             pcache_add(uint, uint, uint, char*);
+int             pcache_has(uint, uint, uint, char*);
+void            pcache_inval(uint, uint, uint, uint);
+int             pcache_shrink(int);
+
+// reclaim.c
+void            reclaiminit(void);
+int             reclaim(int);
+void            reclaim_check(void);
+
+// swap.c
+void            swapinit(struct superblock*);
+int             swapalloc(int);
+void            swapdup(int);
+void            swapfree(int);
+void            swapwrite(int, char**, int);
+void            swapdone(int, int);
+int             swapin(pagetable_t, uint64);
+
+// slab.c
+struct kmem_cache* kmem_cache_create(char*, uint, void (*)(void*));
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+
 // printf.c
 void            printf(char*, ...);
 void            panic(char*) __attribute__((noreturn));
@@ -90,6 +150,7 @@ void            printfinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
+int             spawn(char*, char**, struct file**);
 int             growproc(int);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
@@ -112,9 +173,22 @@ int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
 int             pinfo(uint64);
-uint64		    allocvma(int length, int prot, int flags, struct file* f, int fd, int offset);
+uint64		    allocvma(uint64 addr, int length, int prot, int flags, struct file* f, int fd, int offset, int fixed, struct anon* a);
 void		    allocvmaelf(struct proc *p, int length, int filesz, struct inode* ip, int offset, uint64 vaddr, int text);
 int		        deallocvma(uint64 addr, int size);
+int		        mprotectvma(uint64 addr, int len, int prot);
+int		        msyncvma(uint64 addr, int len, int flags);
+int		        madvisevma(uint64 addr, int len, int advice);
+
+// vma.c
+struct vma*     findvma(struct proc*, uint64);
+struct vma*     vmaoverlap(struct proc*, uint64, uint64);
+uint64          vmagap(struct proc*, uint64);
+int             vmaperm(struct vma*);
+int             vmareserve(struct proc*, int);
+int             vmainsert(struct proc*, struct vma*);
+void            vmaremove(struct proc*, struct vma*);
+void            vmafree(struct proc*);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -122,11 +196,24 @@ void            swtch(struct context*, struct context*);
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
+int             holdingany(void);
 void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 
+// runq.c
+void            runqinit(void);
+void            runqset(struct proc*);
+struct proc*    runqpick(void);
+
+// shm.c
+void            shminit(void);
+int             shmget(int, uint64, int);
+uint64          shmat(int, uint64, int);
+int             shmdt(uint64);
+void            shmrelease(struct anon*);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -159,7 +246,8 @@ int            argfd(int, int *, struct file **);
 // trap.c
 extern uint     ticks;
 void            trapinit(void);
-void            allocPhysicalVMA(struct vma *vma, struct proc *p, uint64 addr, int prot);
+void            allocPhysicalVMA(struct vma *vma, struct proc *p, uint64 addr, int prot, int write);
+int             allocHeap(struct proc *, uint64);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
@@ -175,6 +263,9 @@ int             uartgetc(void);
 void            kvminit(void);
 void            kvminithart(void);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
+pagetable_t     kvmcreate(void);
+void            kvmuser(pagetable_t, pagetable_t);
+void            kvmswitch(pagetable_t);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
 void            uvmfirst(pagetable_t, uchar *, uint);
@@ -185,8 +276,15 @@ int             _uvmcopy(pagetable_t, pagetable_t, uint64, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+void            uvmprotect(pagetable_t, uint64, uint64, int, int);
+void            uvmflushva(uint64);
+int             uvmzero(pagetable_t, uint64, uint64, uint64);
+int             uvmstale(pagetable_t, uint64, int);
 pte_t *         walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
+int             cowfault(pagetable_t, uint64);
+int             splitmega(pagetable_t, uint64);
+pte_t*          megapte(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
@@ -200,11 +298,13 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_rwpages(uint, char **, int, int);
 void            virtio_disk_intr(void);
 
 // random.c
-uint		random(int);
-int		randomrange(int, int, int);
+void		randominit(void);
+uint		random(void);
+int		randomrange(int, int);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
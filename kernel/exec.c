@@ -19,17 +19,20 @@ int flags2perm(int flags)
     return perm;
 }
 
+// Load the program at path into process p, replacing its
+// user memory, with argv on the new stack. p is either the
+// caller (exec) or a new process that has not run yet (spawn).
+// Returns argc, or -1 on failure.
 int
-exec(char *path, char **argv)
+execproc(struct proc *p, char *path, char **argv)
 {
   char *s, *last;
   int i, off;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *image = 0;
   struct proghdr ph;
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
 
   begin_op();
 
@@ -91,18 +94,14 @@ exec(char *path, char **argv)
     //if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
     //  goto bad;
   }
-  allocvmaelf(p, textsz, textfilesz, ip, textoff, textinit, 1);
-  allocvmaelf(p, datasz, datafilesz, ip, dataoff, PGROUNDUP(textinit + textsz), 0);
-  idup(ip);
+  // the text and data VMAs keep a reference to the file; they
+  // are only set up once the new image is committed, so that a
+  // failure leaves p as it was.
+  image = idup(ip);
   iunlockput(ip);
   end_op();
   ip = 0;
 
-  p = myproc();
-
-  /* SETTING UP NUMBER OF TICKS */
-  p->ticks = 0;
-
   sz = PGROUNDUP(textsz) + PGROUNDUP(datasz);
 
   uint64 oldsz = p->sz;
@@ -158,6 +157,15 @@ exec(char *path, char **argv)
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  allocvmaelf(p, textsz, textfilesz, image, textoff, textinit, 1);
+  allocvmaelf(p, datasz, datafilesz, image, dataoff, PGROUNDUP(textinit + textsz), 0);
+
+  /* SETTING UP NUMBER OF TICKS */
+  p->ticks = 0;
+  asidforget(p);
+#ifdef SUMCOPY
+  kvmuser(p->kpagetable, pagetable);
+#endif
   proc_freepagetable(oldpagetable, oldsz);
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
@@ -169,9 +177,20 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(image){
+    begin_op();
+    iput(image);
+    end_op();
+  }
   return -1;
 }
 
+int
+exec(char *path, char **argv)
+{
+  return execproc(myproc(), path, argv);
+}
+
 // Load a program segment into pagetable at virtual address va.
 // va must be page-aligned
 // and the pages from va to va+sz must already be mapped.
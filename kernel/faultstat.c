@@ -0,0 +1,92 @@
+// Page fault statistics.
+//
+// Each fault handler takes r_time() when it starts and calls
+// faultcount() once it has mapped the page, which adds the
+// fault to the faulting process's counters and to the
+// system-wide ones. A fault is major if the handler had to
+// read the page from disk: from the file, for a page the page
+// cache did not have, or from swap. Faults that fail, and the
+// pages mapped around a fault, are not counted.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+struct {
+  struct spinlock lock;
+  struct faultstat fs;
+} faults;
+
+extern struct proc proc[NPROC];
+
+void
+faultstatinit(void)
+{
+  initlock(&faults.lock, "faultstat");
+}
+
+static void
+faultadd(struct faultstat *fs, int type, int major, uint64 ticks, int bucket)
+{
+  if (major)
+    fs->major[type]++;
+  else
+    fs->minor[type]++;
+  fs->ticks[type] += ticks;
+  fs->hist[type][bucket]++;
+}
+
+// Count a fault of type, major or not, whose handler started
+// at time t0. Only the process itself updates its counters.
+void
+faultcount(struct proc *p, int type, int major, uint64 t0)
+{
+  uint64 ticks = r_time() - t0;
+  int bucket = 0;
+
+  while (bucket < NFAULTHIST - 1 && (ticks >> (bucket + 1)) != 0)
+    bucket++;
+
+  faultadd(&p->faults, type, major, ticks, bucket);
+  acquire(&faults.lock);
+  faultadd(&faults.fs, type, major, ticks, bucket);
+  release(&faults.lock);
+}
+
+// Copy the fault statistics of process pid, or of the whole
+// system if pid is 0, to user address addr.
+// Returns 0, or -1 if there is no such process.
+int
+faultinfo(int pid, uint64 addr)
+{
+  struct faultstat fs;
+  struct proc *p;
+  int found = 0;
+
+  if (pid == 0)
+  {
+    acquire(&faults.lock);
+    fs = faults.fs;
+    release(&faults.lock);
+    found = 1;
+  }
+  for (p = proc; p < &proc[NPROC] && !found; p++)
+  {
+    acquire(&p->lock);
+    if (p->state != UNUSED && p->pid == pid)
+    {
+      fs = p->faults;
+      found = 1;
+    }
+    release(&p->lock);
+  }
+  if (!found)
+    return -1;
+  if (copyout(myproc()->pagetable, addr, (char *)&fs, sizeof(fs)) < 0)
+    return -1;
+  return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef _FAULTSTAT_H_
+#define _FAULTSTAT_H_
+
+// Page fault statistics, per process and for the whole
+// system, as returned by faultstat().
+
+// fault types
+#define FAULT_TEXT    0   // text page
+#define FAULT_DATA    1   // data page of the executable
+#define FAULT_MMAP    2   // page of a file mapping
+#define FAULT_ANON    3   // heap, anonymous mapping, or swapped-out page
+#define FAULT_COW     4   // write to a copy-on-write page
+#define NFAULTTYPE    5
+
+// latency histogram: bucket i counts faults that took
+// [2^i, 2^(i+1)) rdtime ticks to serve, the last one more.
+#define NFAULTHIST   20
+
+struct faultstat {
+  uint minor[NFAULTTYPE];             // served from memory
+  uint major[NFAULTTYPE];             // read from the file or swap
+  uint64 ticks[NFAULTTYPE];           // total rdtime ticks spent serving them
+  uint hist[NFAULTTYPE][NFAULTHIST];  // latency histogram
+};
+
+#endif // _FAULTSTAT_H_
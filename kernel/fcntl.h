@@ -15,6 +15,29 @@
 #define PROT_EXEC       0x006
 #define MAP_SHARED      0x004
 #define MAP_PRIVATE     0x005
+#define MAP_TYPE        0x00f   // MAP_SHARED or MAP_PRIVATE
+#define MAP_FIXED       0x010   // map exactly at addr, replacing old mappings
+#define MAP_ANONYMOUS   0x020   // zero-filled memory, no file (fd is ignored)
+
+// ADVICE FOR MADVISE
+
+#define MADV_NORMAL     0       // default fault-around
+#define MADV_RANDOM     1       // no fault-around
+#define MADV_SEQUENTIAL 2       // full fault-around, drop pages behind
+#define MADV_WILLNEED   3       // fault the range in now
+#define MADV_DONTNEED   4       // drop the range's pages now
+
+// FLAGS FOR MSYNC
+
+#define MS_ASYNC        0x001   // return at once, write back later
+#define MS_SYNC         0x004   // write back before returning
+
+// FLAGS FOR SHMGET AND SHMAT
+
+#define IPC_PRIVATE     0       // key for a new segment no one else can find
+#define IPC_CREAT       0x200   // create the segment if the key has none
+#define IPC_EXCL        0x400   // with IPC_CREAT, fail if it exists
+#define SHM_RDONLY      0x1000  // attach read-only
 
 // define ret val
 
@@ -44,6 +44,7 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  swapinit(&sb);
 }
 
 // Zero a block.
@@ -164,29 +165,42 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// In-memory inodes are allocated from itable.cache when iget()
+// first needs one and freed by iput() when the last reference
+// goes away. itable.hash finds the in-memory copy of an
+// i-node by (dev, inum) without scanning every active inode.
+//
+// The itable.lock spin-lock protects the hash chains and the
+// allocation of itable entries. Since ip->ref indicates whether
+// an entry is in use, and ip->dev and ip->inum indicate which
+// i-node an entry holds, one must hold itable.lock while using
+// any of those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 31
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kmem_cache *cache;
+  struct inode *hash[NIHASH];
 } itable;
 
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIHASH)
+
+static void
+inodector(void *o)
+{
+  initsleeplock(&((struct inode*)o)->lock, "inode");
+}
+
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  itable.cache = kmem_cache_create("inode", sizeof(struct inode), inodector);
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -246,31 +260,30 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
+  uint h = IHASH(dev, inum);
 
   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+  for(ip = itable.hash[h]; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
       ip->ref++;
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
+  // Allocate an inode entry.
+  if((ip = kmem_cache_alloc(itable.cache)) == 0)
     panic("iget: no inodes");
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->next = itable.hash[h];
+  itable.hash[h] = ip;
   release(&itable.lock);
 
   return ip;
@@ -327,8 +340,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode table entry can
-// be recycled.
+// If that was the last reference, the inode table entry is
+// freed.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -357,7 +370,14 @@ iput(struct inode *ip)
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref == 0){
+    struct inode **pp;
+
+    for(pp = &itable.hash[IHASH(ip->dev, ip->inum)]; *pp != ip; pp = &(*pp)->next)
+      ;
+    *pp = ip->next;
+    kmem_cache_free(itable.cache, ip);
+  }
   release(&itable.lock);
 }
 
@@ -429,6 +449,8 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  pcache_inval(ip->dev, ip->inum, 0, MAXFILE*BSIZE);
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -495,6 +517,41 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   return tot;
 }
 
+// Read up to n whole pages of ip, starting at offset off,
+// straight into pages with a single disk request, bypassing
+// the buffer cache. Stops at the end of the file and at the
+// first page whose blocks do not follow on from the previous
+// ones on disk. Returns the number of pages read, 0 if off
+// is not block-aligned or one of the blocks is cached.
+// Caller must hold ip->lock.
+int
+readi_pages(struct inode *ip, uint off, char **pages, int n)
+{
+  uint bn, addr, first = 0;
+  int i, k;
+
+  if(off % BSIZE != 0)
+    return 0;
+
+  bn = off / BSIZE;
+  for(i = 0; i < n && off + (i + 1) * PGSIZE <= ip->size; i++){
+    for(k = 0; k < PGSIZE / BSIZE; k++, bn++){
+      addr = bmap(ip, bn);
+      if(bn == off / BSIZE)
+        first = addr;
+      if(addr == 0 || addr != first + (bn - off / BSIZE))
+        break;
+    }
+    if(k < PGSIZE / BSIZE)
+      break;
+  }
+
+  if(i == 0 || bcached(ip->dev, first, i * (PGSIZE / BSIZE)))
+    return 0;
+  virtio_disk_rwpages(first, pages, i, 0);
+  return i;
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -513,6 +570,9 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
+  // mapped pages keep the old data; later faults must not.
+  pcache_inval(ip->dev, ip->inum, off, n);
+
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
@@ -1,6 +1,26 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or physically contiguous blocks of 2^order pages.
+//
+// The global pool is a binary buddy allocator: kmem.free[k]
+// lists the free blocks of 2^k pages, each block aligned to
+// its own size. Allocation splits the smallest large-enough
+// block; freeing merges a block with its buddy for as long
+// as the buddy is free too.
+//
+// Each hart keeps a private cache of free pages so that the
+// common kalloc()/kfree() path only takes that hart's own lock.
+// Caches are refilled from and drained to the buddy pool in
+// batches of KBATCH pages; a hart whose cache and the global
+// pool are both empty steals half of another hart's cache.
+//
+// Each hart also keeps a small pool of pages that its idle
+// loop has already zeroed (see kzero_idle()), which is what
+// kalloc_zeroed() hands out first. Filling pages with junk on
+// allocation and free, to catch dangling references, costs a
+// full-page write each time and is only done in kernels built
+// with KALLOC_DEBUG (make KALLOC_DEBUG=1).
 
 #include "types.h"
 #include "param.h"
@@ -9,43 +29,160 @@
 #include "riscv.h"
 #include "defs.h"
 
-#define MAXPAGES (PHYSTOP / PGSIZE)
+#define NPAGES   ((PHYSTOP - KERNBASE) / PGSIZE)
+#define KMAXORDER 10          // largest block: 2^10 pages (4MB)
+#define KBATCH   32           // pages moved to/from the global pool at once
+#define KCPUMAX  (2*KBATCH)   // drain a hart's cache above this many pages
+#define KZEROMAX 64           // pre-zeroed pages kept per hart
 
 void _freerange(void *pa_vstart, void *pa_vend);
 void freerange(void *pa_start, void *pa_end);
-void _kfree(void *pa);
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
 struct run {
   struct run *next;
-  uint ref; // reference count
+  struct run *prev;   // buddy free lists are doubly linked
+  uint ref;           // reference count
+  uchar order;        // size of the free block this page heads
+  uchar free;         // heads a block on kmem.free[order]
 };
 
-struct {
+// Per-hart free page cache. The lock is only ever
+// contended by another hart stealing pages.
+struct kcpu {
   struct spinlock lock;
   struct run *freelist;
+  int nfree;
+  struct run *zerolist;       // pages known to be all zeroes
+  int nzero;
+};
+
+struct {
+  struct spinlock lock;       // protects free[] and the buddy fields
+  struct run *free[KMAXORDER+1];
+  int npages;                 // pages on free[]
+  struct kcpu pcpu[NCPU];
   // DEP: For COW fork, we can't store the run in the 
   //      physical page, because we need space for the ref
   //      count.  Move to the kmem struct.
-  struct run runs[MAXPAGES];
+  struct run runs[NPAGES];
 } kmem;
 
+#define pa2run(pa) (&kmem.runs[((uint64)(pa) - KERNBASE) / PGSIZE])
+#define run2pa(r)  ((void*)(KERNBASE + ((r) - kmem.runs) * PGSIZE))
+
+static void kput_cpus(void);
+
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem.pcpu[i].lock, "kmem_cpu");
   _freerange(end, (void*)PHYSTOP);
 }
 
+static void
+bpush(struct run *r, int order)
+{
+  r->order = order;
+  r->free = 1;
+  kmem.npages += 1 << order;
+  r->prev = 0;
+  r->next = kmem.free[order];
+  if(r->next)
+    r->next->prev = r;
+  kmem.free[order] = r;
+}
+
+static void
+bremove(struct run *r)
+{
+  if(r->prev)
+    r->prev->next = r->next;
+  else
+    kmem.free[r->order] = r->next;
+  if(r->next)
+    r->next->prev = r->prev;
+  r->free = 0;
+  kmem.npages -= 1 << r->order;
+}
+
+// Take a block of 2^order pages from the buddy pool,
+// splitting a larger block if needed.
+// Caller must hold kmem.lock.
+static struct run *
+bget(int order)
+{
+  struct run *r;
+  int k;
+
+  for(k = order; k <= KMAXORDER && kmem.free[k] == 0; k++)
+    ;
+  if(k > KMAXORDER)
+    return 0;
+
+  r = kmem.free[k];
+  bremove(r);
+  // give back the upper halves we don't need.
+  while(k > order){
+    k--;
+    bpush(r + (1 << k), k);
+  }
+  return r;
+}
+
+// Return a block of 2^order pages to the buddy pool,
+// merging it with its buddy while the buddy is free.
+// Caller must hold kmem.lock.
+static void
+bput(struct run *r, int order)
+{
+  struct run *b;
+  uint64 i;
+
+  while(order < KMAXORDER){
+    i = (r - kmem.runs) ^ (1L << order);
+    if(i >= NPAGES)
+      break;
+    b = &kmem.runs[i];
+    if(!b->free || b->order != order)
+      break;
+    bremove(b);
+    if(b < r)
+      r = b;
+    order++;
+  }
+  bpush(r, order);
+}
+
+// Hand the boot-time free memory to the buddy pool
+// as the largest aligned blocks that fit.
 void
 _freerange(void *pa_start, void *pa_end)
 {
   char *p;
+  int order;
+  uint64 i;
+
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    _kfree(p);
+  acquire(&kmem.lock);
+  while(p + PGSIZE <= (char*)pa_end){
+    i = pa2run(p) - kmem.runs;
+    order = KMAXORDER;
+    while(order > 0 &&
+          ((i & ((1L << order) - 1)) != 0 || p + ((uint64)PGSIZE << order) > (char*)pa_end))
+      order--;
+#ifdef KALLOC_DEBUG
+    // Fill with junk to catch dangling refs.
+    memset(p, 1, (uint64)PGSIZE << order);
+#endif
+    bput(pa2run(p), order);
+    p += (uint64)PGSIZE << order;
+  }
+  release(&kmem.lock);
 }
 
 void
@@ -57,31 +194,168 @@ freerange(void *pa_start, void *pa_end)
     kfree(p);
 }
 
-// Called by _freerange, which is only called by kinit.
-void
-_kfree(void *pa)
+// Move a batch of pages from the buddy pool into
+// hart id's cache, or if the pool is empty steal half of
+// another hart's cache. Returns one of the pages and
+// leaves the rest in the cache, or 0 if memory is exhausted.
+// Must be called with interrupts off, without kc->lock.
+static struct run *
+krefill(int id)
 {
-  struct run *r;
+  struct kcpu *kc = &kmem.pcpu[id];
+  struct kcpu *victim;
+  struct run *r, *head = 0, *tail = 0;
+  int n = 0, take;
 
-  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
-    panic("_kfree");
+  acquire(&kmem.lock);
+  while(n < KBATCH && (r = bget(0)) != 0){
+    r->next = head;
+    if(head == 0)
+      tail = r;
+    head = r;
+    n++;
+  }
+  release(&kmem.lock);
 
-  // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
+  for(int i = 1; n == 0 && i < NCPU; i++){
+    victim = &kmem.pcpu[(id + i) % NCPU];
+    acquire(&victim->lock);
+    take = (victim->nfree + 1) / 2;
+    while(n < take){
+      r = victim->freelist;
+      victim->freelist = r->next;
+      victim->nfree--;
+      r->next = head;
+      if(head == 0)
+        tail = r;
+      head = r;
+      n++;
+    }
+    release(&victim->lock);
+  }
+
+  // last resort: pages that idle harts have zeroed.
+  for(int i = 0; n == 0 && i < NCPU; i++){
+    victim = &kmem.pcpu[(id + i) % NCPU];
+    acquire(&victim->lock);
+    if((r = victim->zerolist) != 0){
+      victim->zerolist = r->next;
+      victim->nzero--;
+      r->next = 0;
+      head = tail = r;
+      n++;
+    }
+    release(&victim->lock);
+  }
 
-  r = &kmem.runs[(uint64)pa / PGSIZE];
+  if(n == 0)
+    return 0;
+
+  r = head;
+  head = head->next;
+  if(--n > 0){
+    acquire(&kc->lock);
+    tail->next = kc->freelist;
+    kc->freelist = head;
+    kc->nfree += n;
+    release(&kc->lock);
+  }
+  return r;
+}
+
+// Return KBATCH pages from hart id's cache to the
+// buddy pool. Must be called with interrupts off,
+// without kc->lock.
+static void
+kdrain(int id)
+{
+  struct kcpu *kc = &kmem.pcpu[id];
+  struct run *head, *tail, *r;
+  int n;
+
+  acquire(&kc->lock);
+  head = tail = kc->freelist;
+  for(n = 1; n < KBATCH && tail && tail->next; n++)
+    tail = tail->next;
+  if(head == 0){
+    release(&kc->lock);
+    return;
+  }
+  kc->freelist = tail->next;
+  kc->nfree -= n;
+  tail->next = 0;
+  release(&kc->lock);
 
   acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
+  while((r = head) != 0){
+    head = r->next;
+    bput(r, 0);
+  }
   release(&kmem.lock);
 }
 
+// Give every page in every hart's cache back to the
+// buddy pool, so that they can merge into larger blocks.
+// Used when a multi-page allocation fails. The pre-zeroed
+// pages go too: a multi-page allocation matters more than
+// the zeroing kzero_idle() will redo.
+static void
+kput_cpus(void)
+{
+  struct kcpu *kc;
+  struct run *head, *zero, *r;
+
+  for(kc = kmem.pcpu; kc < &kmem.pcpu[NCPU]; kc++){
+    acquire(&kc->lock);
+    head = kc->freelist;
+    kc->freelist = 0;
+    kc->nfree = 0;
+    zero = kc->zerolist;
+    kc->zerolist = 0;
+    kc->nzero = 0;
+    release(&kc->lock);
+
+    acquire(&kmem.lock);
+    while((r = head) != 0){
+      head = r->next;
+      bput(r, 0);
+    }
+    while((r = zero) != 0){
+      zero = r->next;
+      bput(r, 0);
+    }
+    release(&kmem.lock);
+  }
+}
+
+// Put r on this hart's free page cache, draining
+// a batch to the global pool if the cache is full.
+static void
+kpush(struct run *r)
+{
+  struct kcpu *kc;
+  int id, drain;
+
+  push_off();
+  id = cpuid();
+  kc = &kmem.pcpu[id];
+  acquire(&kc->lock);
+  r->next = kc->freelist;
+  kc->freelist = r;
+  drain = ++kc->nfree > KCPUMAX;
+  release(&kc->lock);
+
+  if(drain)
+    kdrain(id);
+  pop_off();
+}
 
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// The caller must hold the only reference; pages
+// that may be shared should be released with kput().
 void
 kfree(void *pa)
 {
@@ -90,49 +364,314 @@ kfree(void *pa)
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
-  // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
-
-  r = &kmem.runs[(uint64)pa / PGSIZE];
+  r = pa2run(pa);
   if (r->ref != 1) {
     // assert ref == 1
     printf("kfree: assert ref == 1 failed\n");
     printf("0x%x %d\n", r, r->ref);
     exit(-1);
   }
-  
+  r->ref = 0;
+
+#ifdef KALLOC_DEBUG
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, PGSIZE);
+#endif
+
+  kpush(r);
+}
+
+// Drop a reference to the page at pa, and free it
+// if that was the last one. The decrement and the
+// zero test are a single atomic operation, so two
+// harts releasing a shared page concurrently cannot
+// both miss (or both perform) the free.
+void
+kput(void *pa)
+{
+  struct run *r;
+  uint ref;
+
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kput");
+
+  r = pa2run(pa);
+  ref = __sync_sub_and_fetch(&r->ref, 1);
+  if(ref == (uint)-1)
+    panic("kput: ref");
+  if(ref > 0)
+    return;
+
+#ifdef KALLOC_DEBUG
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, PGSIZE);
+#endif
+
+  kpush(r);
+}
+
+// Drop a reference to the page at pa like kput(), but if
+// that was the last one, add the page to the caller's list
+// *batch instead of freeing it. kbatch_free() then returns
+// the whole list to the allocator at once. Used to tear
+// down an address space without a lock round trip per page.
+void
+kbatch_put(struct run **batch, void *pa)
+{
+  struct run *r;
+  uint ref;
+
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kbatch_put");
+
+  r = pa2run(pa);
+  ref = __sync_sub_and_fetch(&r->ref, 1);
+  if(ref == (uint)-1)
+    panic("kbatch_put: ref");
+  if(ref > 0)
+    return;
+
+#ifdef KALLOC_DEBUG
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, PGSIZE);
+#endif
+
+  r->next = *batch;
+  *batch = r;
+}
+
+// Free a list of pages built by kbatch_put(). This hart's
+// cache is topped up to KCPUMAX pages under one acquire of
+// its lock, and the rest goes to the buddy pool under one
+// acquire of kmem.lock, where it can merge into large blocks.
+void
+kbatch_free(struct run *batch)
+{
+  struct kcpu *kc;
+  struct run *head, *tail, *r;
+  int n;
+
+  if(batch == 0)
+    return;
+
+  push_off();
+  kc = &kmem.pcpu[cpuid()];
+  acquire(&kc->lock);
+  head = tail = 0;
+  for(n = kc->nfree; n < KCPUMAX && batch; n++){
+    r = batch;
+    batch = r->next;
+    r->next = head;
+    if(head == 0)
+      tail = r;
+    head = r;
+  }
+  if(head){
+    tail->next = kc->freelist;
+    kc->freelist = head;
+    kc->nfree = n;
+  }
+  release(&kc->lock);
+  pop_off();
+
+  if(batch == 0)
+    return;
   acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
+  while((r = batch) != 0){
+    batch = r->next;
+    bput(r, 0);
+  }
   release(&kmem.lock);
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// The contents of the page are undefined; use
+// kalloc_zeroed() if the caller needs zeroes.
 void *
 kalloc(void)
 {
   struct run *r;
+  struct kcpu *kc;
+  int id;
+
+  push_off();
+  id = cpuid();
+  kc = &kmem.pcpu[id];
+  acquire(&kc->lock);
+  if((r = kc->freelist) != 0){
+    kc->freelist = r->next;
+    kc->nfree--;
+  } else if((r = kc->zerolist) != 0){
+    kc->zerolist = r->next;
+    kc->nzero--;
+  }
+  release(&kc->lock);
+  if(r == 0)
+    r = krefill(id);
+  pop_off();
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
   if(r){
     r->ref = 1;
-    kmem.freelist = r->next;
+#ifdef KALLOC_DEBUG
+    memset((char*)run2pa(r), 5, PGSIZE); // fill with junk
+#endif
+    return run2pa(r);
+  }  
+  return (void*)0;
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their total size. Every page in the block starts
+// with a reference count of one.
+// Returns 0 if no block that large is free.
+void *
+kalloc_pages(int order)
+{
+  struct run *r;
+
+  if(order < 0 || order > KMAXORDER)
+    return 0;
+  if(order == 0)
+    return kalloc();
+
+  acquire(&kmem.lock);
+  r = bget(order);
+  release(&kmem.lock);
+  if(r == 0){
+    // the pages may be sitting in the harts' caches.
+    kput_cpus();
+    acquire(&kmem.lock);
+    r = bget(order);
+    release(&kmem.lock);
   }
+  if(r == 0)
+    return 0;
+
+  for(int i = 0; i < (1 << order); i++)
+    r[i].ref = 1;
+#ifdef KALLOC_DEBUG
+  memset(run2pa(r), 5, (uint64)PGSIZE << order); // fill with junk
+#endif
+  return run2pa(r);
+}
+
+// Free a block returned by kalloc_pages(order). The
+// caller must hold the only reference to every page.
+// A block may instead be released one page at a time
+// with kfree() or kput(); the pages merge back as their
+// buddies are freed.
+void
+kfree_pages(void *pa, int order)
+{
+  struct run *r;
+
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(order < 0 || order > KMAXORDER ||
+     ((uint64)pa - KERNBASE) % ((uint64)PGSIZE << order) != 0 ||
+     (char*)pa < end || (uint64)pa + ((uint64)PGSIZE << order) > PHYSTOP)
+    panic("kfree_pages");
+
+  r = pa2run(pa);
+  for(int i = 0; i < (1 << order); i++){
+    if(r[i].ref != 1)
+      panic("kfree_pages: ref");
+    r[i].ref = 0;
+  }
+
+#ifdef KALLOC_DEBUG
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, (uint64)PGSIZE << order);
+#endif
+
+  acquire(&kmem.lock);
+  bput(r, order);
   release(&kmem.lock);
+}
+
+// Allocate one zero-filled page of physical memory,
+// preferably one the idle loop has already cleared.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+  struct kcpu *kc;
+  void *pa;
+
+  push_off();
+  kc = &kmem.pcpu[cpuid()];
+  acquire(&kc->lock);
+  if((r = kc->zerolist) != 0){
+    kc->zerolist = r->next;
+    kc->nzero--;
+  }
+  release(&kc->lock);
+  pop_off();
 
   if(r){
-    memset((char*)((r - kmem.runs) * PGSIZE), 5, PGSIZE); // fill with junk
-    return (void*)((r - kmem.runs) * PGSIZE);
-  }  
-  return (void*)0;
+    r->ref = 1;
+    return run2pa(r);
+  }
+
+  if((pa = kalloc()) != 0)
+    memset(pa, 0, PGSIZE);
+  return pa;
 }
 
+// Called by the scheduler when this hart has nothing to
+// run. Zeroes one page from the hart's free cache and moves
+// it to the pre-zeroed pool, until the pool holds KZEROMAX.
+void
+kzero_idle(void)
+{
+  struct run *r = 0;
+  struct kcpu *kc;
+
+  push_off();
+  kc = &kmem.pcpu[cpuid()];
+  acquire(&kc->lock);
+  if(kc->nzero < KZEROMAX && (r = kc->freelist) != 0){
+    kc->freelist = r->next;
+    kc->nfree--;
+  }
+  release(&kc->lock);
+
+  if(r){
+    // the page is off every list, so it can be cleared
+    // without holding the lock.
+    memset((char*)run2pa(r), 0, PGSIZE);
+    acquire(&kc->lock);
+    r->next = kc->zerolist;
+    kc->zerolist = r;
+    kc->nzero++;
+    release(&kc->lock);
+  }
+  pop_off();
+}
+
+
+// Return the number of free pages, counting the buddy
+// pool and every hart's caches. The counts are read
+// without locks, so the result is only an estimate.
+int
+kfreepages(void)
+{
+  int n = *(volatile int *)&kmem.npages;
+
+  for(int i = 0; i < NCPU; i++)
+    n += *(volatile int *)&kmem.pcpu[i].nfree + *(volatile int *)&kmem.pcpu[i].nzero;
+  return n;
+}
 
 /**
  * Increment the reference count of a page descriptor.
+ * On RISC-V __sync_fetch_and_add turns into an amoadd.w,
+ * so no lock is needed.
  */
 void
 incref(void *pa)
@@ -142,16 +681,16 @@ incref(void *pa)
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("incref");
 
-  acquire(&kmem.lock);
-  r = &kmem.runs[(uint64)pa / PGSIZE];
-  r->ref++;
-  release(&kmem.lock);
+  r = pa2run(pa);
+  __sync_fetch_and_add(&r->ref, 1);
 }
 
 /**
- * Decrement the reference count of a page descriptor.
+ * Decrement the reference count of a page descriptor
+ * and return the new count. Never frees the page;
+ * use kput() to drop a reference that may be the last.
  */
-void
+uint
 decref(void *pa)
 {
   struct run *r;
@@ -159,20 +698,20 @@ decref(void *pa)
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("decref");
 
-  acquire(&kmem.lock);
-  r = &kmem.runs[(uint64)pa / PGSIZE];
-  r->ref--;
-  release(&kmem.lock);
+  r = pa2run(pa);
+  return __sync_sub_and_fetch(&r->ref, 1);
 }
 
 /**
  * Get reference count of a page descriptor.
+ * The value may be stale by the time the caller looks
+ * at it, unless the caller holds the only reference.
  */
 uint
 getref(void *pa)
 {
-  struct run *r = &kmem.runs[(uint64)pa / PGSIZE];
-  return r->ref;
+  struct run *r = pa2run(pa);
+  return *(volatile uint *)&r->ref;
 }
 
 /**
@@ -181,6 +720,6 @@ getref(void *pa)
 void
 printref(char *pa)
 {
-  struct run *r = &kmem.runs[(uint64)pa / PGSIZE];
+  struct run *r = pa2run(pa);
   printf("printref: address: 0x%p, ref: %d\n", r, r->ref);
 }
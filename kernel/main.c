@@ -19,7 +19,14 @@ main()
     kinit();         // physical page allocator
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
+    asidinit();      // address-space identifiers
     procinit();      // process table
+    runqinit();      // lottery run queue
+    reclaiminit();   // page reclaim clock
+    pcacheinit();    // page cache
+    anoninit();      // shared anonymous memory
+    shminit();       // shared memory segments
+    faultstatinit(); // page fault statistics
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
@@ -27,7 +34,9 @@ main()
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    pipeinit();      // pipe cache
     virtio_disk_init(); // emulated hard disk
+    randominit();    // this hart's lottery random numbers
     userinit();      // first user process
     __sync_synchronize();
     started = 1;
@@ -39,6 +48,7 @@ main()
     kvminithart();    // turn on paging
     trapinithart();   // install kernel trap vector
     plicinithart();   // ask PLIC for device interrupts
+    randominit();     // this hart's lottery random numbers
   }
 
   scheduler();        
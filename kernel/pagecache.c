@@ -0,0 +1,218 @@
+// Page cache for file pages mapped into user memory.
+//
+// allocPhysicalVMA() reads text pages, and pages of private
+// mmap regions, through this cache, so that processes mapping
+// the same part of the same file share one physical page
+// rather than each reading its own copy. A cached page is
+// always mapped read-only: text is never written, and a write
+// to a private mapping gets its own copy from cowfault().
+//
+// Entries are found by (dev, inum, file offset) and hold one
+// reference to their page; every mapping of the page holds
+// another. writei() and itrunc() drop the entries they
+// overlap, leaving existing mappings with the old contents.
+// reclaim() calls pcache_shrink() to free the pages that no
+// page table maps any more.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "defs.h"
+
+#define NPCACHE 256   // cached pages
+#define NPCHASH 61    // hash buckets
+#define PCHASH(dev, inum, off) (((dev) * 31 + (inum) * 17 + (off) / PGSIZE) % NPCHASH)
+
+struct pcpage {
+  struct pcpage *next;  // hash chain
+  uint dev;
+  uint inum;
+  uint off;             // file offset of the page's first byte
+  char *pa;             // 0 if the entry is free
+};
+
+struct {
+  struct spinlock lock;
+  struct pcpage page[NPCACHE];
+  struct pcpage *hash[NPCHASH];
+  int n;                // entries in use
+  int hand;             // next entry pcache_shrink() looks at
+} pcache;
+
+void
+pcacheinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+}
+
+// Caller holds pcache.lock.
+static struct pcpage *
+pcache_find(uint dev, uint inum, uint off)
+{
+  struct pcpage *pg;
+
+  for (pg = pcache.hash[PCHASH(dev, inum, off)]; pg; pg = pg->next)
+    if (pg->dev == dev && pg->inum == inum && pg->off == off)
+      return pg;
+  return 0;
+}
+
+// Remove pg from the cache and drop its reference.
+// Caller holds pcache.lock.
+static void
+pcache_drop(struct pcpage *pg)
+{
+  struct pcpage **pp;
+
+  for (pp = &pcache.hash[PCHASH(pg->dev, pg->inum, pg->off)]; *pp != pg; pp = &(*pp)->next)
+    ;
+  *pp = pg->next;
+  kput(pg->pa);
+  pg->pa = 0;
+  pcache.n--;
+}
+
+// Return the cached page holding the PGSIZE bytes of the file
+// at off, with a new reference for the caller, or 0.
+// Caller holds the inode's lock.
+char *
+pcache_get(uint dev, uint inum, uint off)
+{
+  struct pcpage *pg;
+  char *pa = 0;
+
+  acquire(&pcache.lock);
+  if ((pg = pcache_find(dev, inum, off)) != 0)
+  {
+    pa = pg->pa;
+    incref(pa);
+  }
+  release(&pcache.lock);
+  return pa;
+}
+
+// Offer pa, which holds the PGSIZE bytes of the file at off,
+// to the cache. If it is kept the cache takes its own
+// reference, and the caller must map pa read-only. Returns 1
+// if pa was cached. Caller holds the inode's lock.
+int
+pcache_add(uint dev, uint inum, uint off, char *pa)
+{
+  struct pcpage *pg = 0;
+  int h;
+
+  acquire(&pcache.lock);
+  if (pcache_find(dev, inum, off))
+  {
+    release(&pcache.lock);
+    return 0;
+  }
+  // a free entry, or one whose page nobody maps any more.
+  for (int i = 0; i < NPCACHE && pg == 0; i++)
+  {
+    h = (pcache.hand + i) % NPCACHE;
+    if (pcache.page[h].pa == 0)
+      pg = &pcache.page[h];
+    else if (getref(pcache.page[h].pa) == 1)
+      pcache_drop(pg = &pcache.page[h]);
+  }
+  if (pg == 0)
+  {
+    release(&pcache.lock);
+    return 0;
+  }
+  pg->dev = dev;
+  pg->inum = inum;
+  pg->off = off;
+  pg->pa = pa;
+  incref(pa);
+  h = PCHASH(dev, inum, off);
+  pg->next = pcache.hash[h];
+  pcache.hash[h] = pg;
+  pcache.n++;
+  release(&pcache.lock);
+  return 1;
+}
+
+// Return 1 if pa is the cached page for (dev, inum, off).
+int
+pcache_has(uint dev, uint inum, uint off, char *pa)
+{
+  struct pcpage *pg;
+  int r;
+
+  acquire(&pcache.lock);
+  r = (pg = pcache_find(dev, inum, off)) != 0 && pg->pa == pa;
+  release(&pcache.lock);
+  return r;
+}
+
+// Drop the entries of bucket b for (dev, inum) whose
+// offset is in [start, end). Caller holds pcache.lock.
+static void
+pcache_invalbucket(int b, uint dev, uint inum, uint64 start, uint64 end)
+{
+  struct pcpage *pg, *next;
+
+  for (pg = pcache.hash[b]; pg; pg = next)
+  {
+    next = pg->next;
+    if (pg->dev == dev && pg->inum == inum && pg->off >= start && pg->off < end)
+      pcache_drop(pg);
+  }
+}
+
+// Forget the cached pages that overlap bytes [off, off+n) of
+// the file, whose contents are about to change.
+// Caller holds the inode's lock.
+void
+pcache_inval(uint dev, uint inum, uint off, uint n)
+{
+  uint64 start, end;
+
+  if (*(volatile int *)&pcache.n == 0 || n == 0)
+    return;
+
+  // an entry at o overlaps if o < off+n and o+PGSIZE > off.
+  start = off < PGSIZE ? 0 : off - PGSIZE + 1;
+  end = (uint64)off + n;
+
+  acquire(&pcache.lock);
+  if ((end - start) / PGSIZE < NPCHASH)
+  {
+    // only the buckets the offsets in the range hash to.
+    for (uint64 o = PGROUNDDOWN(start); o < end; o += PGSIZE)
+      pcache_invalbucket(PCHASH(dev, inum, o), dev, inum, start, end);
+  }
+  else
+  {
+    for (int b = 0; b < NPCHASH; b++)
+      pcache_invalbucket(b, dev, inum, start, end);
+  }
+  release(&pcache.lock);
+}
+
+// Free up to n cached pages that no page table maps.
+// Returns the number freed.
+int
+pcache_shrink(int n)
+{
+  struct pcpage *pg;
+  int k = 0;
+
+  acquire(&pcache.lock);
+  for (int i = 0; i < NPCACHE && k < n; i++)
+  {
+    pg = &pcache.page[pcache.hand];
+    pcache.hand = (pcache.hand + 1) % NPCACHE;
+    if (pg->pa && getref(pg->pa) == 1)
+    {
+      pcache_drop(pg);
+      k++;
+    }
+  }
+  release(&pcache.lock);
+  return k;
+}
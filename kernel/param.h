@@ -1,7 +1,6 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
@@ -10,6 +9,9 @@
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       2000  // size of file system in blocks
+#define SWAPSIZE     8192  // size of swap area after the file system, in blocks
 #define MAXPATH      128   // maximum file path name
-#define PER_PROCESS_VMAS    4
-#define NVMAS        (PER_PROCESS_VMAS * NPROC)    // 4 * NPROC
+#define NRECLAIM     32  // pages evicted per reclaim pass
+#define SWAPCLUSTER   8  // pages per swap write
+#define FAULTAROUND   8  // most pages mapped by one file-backed page fault
+#define NSHM         16  // shared memory segments
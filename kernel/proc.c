@@ -15,8 +15,9 @@ struct cpu cpus[NCPU];
 
 struct proc proc[NPROC];
 
-// GLOBAL
-struct vma vmas[NVMAS];
+// mmap VMAs are allocated from vmacache; text and data
+// VMAs are embedded in struct proc.
+struct kmem_cache *vmacache;
 
 struct proc *initproc;
 
@@ -52,7 +53,15 @@ void proc_mapstacks(pagetable_t kpgtbl)
   }
 }
 
-// initialize the proc and VMA table.
+static void
+vmactor(void *o)
+{
+  struct vma *vma = o;
+  initlock(&vma->lock, "vma");
+  vma->used = 0;
+}
+
+// initialize the proc table and the VMA cache.
 void procinit(void)
 {
   struct proc *p;
@@ -66,12 +75,7 @@ void procinit(void)
     p->kstack = KSTACK((int)(p - proc));
   }
 
-  struct vma *vma;
-  for (vma = vmas; vma < &vmas[NVMAS]; vma++)
-  {
-    initlock(&vma->lock, "vma");
-    vma->used = 0;
-  }
+  vmacache = kmem_cache_create("vma", sizeof(struct vma), vmactor);
 }
 
 // Must be called with interrupts disabled,
@@ -143,8 +147,10 @@ found:
   p->pid = allocpid();
   p->state = USED;
 
-  p->nmp = TRAPFRAME;
   p->page_faults = 0;
+  p->ticks = 0;
+  memset(&p->faults, 0, sizeof(p->faults));
+  asidforget(p);
 
   // Allocate a trapframe page.
   if ((p->trapframe = (struct trapframe *)kalloc()) == 0)
@@ -163,6 +169,16 @@ found:
     return 0;
   }
 
+#ifdef SUMCOPY
+  // Its kernel page table, with an alias of its user memory.
+  if ((p->kpagetable = kvmcreate()) == 0)
+  {
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
+#endif
+
   // Set up new context to start executing at forkret,
   // which returns to user space.
   memset(&p->context, 0, sizeof(p->context));
@@ -184,7 +200,11 @@ freeproc(struct proc *p)
   if (p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
+  if (p->kpagetable)
+    kfree((void *)p->kpagetable);
+  p->kpagetable = 0;
   p->sz = 0;
+  vmafree(p);
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
@@ -272,33 +292,137 @@ void userinit(void)
   p->cwd = namei("/");
   p->tickets = 1; /* DEFAULT PRIORITY */
   p->state = RUNNABLE;
+  runqset(p);
 
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
+// Growing only moves p->sz: allocHeap() maps zeroed pages as
+// they are first touched. Shrinking frees the pages (and swap
+// slots) at once. The heap cannot grow into the lowest mmap
+// VMA, nor shrink into the text and data.
 // Return 0 on success, -1 on failure.
 int growproc(int n)
 {
-  uint64 sz;
+  uint64 sz, top, base;
   struct proc *p = myproc();
 
   sz = p->sz;
   if (n > 0)
   {
-    if ((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0)
-    {
+    top = p->nvma > 0 ? p->vmas[0]->addr : TRAPFRAME;
+    if (sz > top || n > top - sz)
       return -1;
-    }
+    sz += n;
   }
   else if (n < 0)
   {
+    base = p->text.addr + p->text.size;
+    if (p->data.used && base < p->data.addr + p->data.size)
+      base = p->data.addr + p->data.size;
+    if (-(uint64)n > sz - base)
+      return -1;
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
   p->sz = sz;
   return 0;
 }
 
+// Give np copies of p's mmap VMAs, at the same addresses, with
+// the pages mapped so far shared: private ones copy-on-write.
+// Returns 0, or -1 if out of memory, with the VMAs copied so
+// far left in np for forkvmafree().
+static int
+forkvmas(struct proc *p, struct proc *np)
+{
+  for (int i = 0; i < p->nvma; i++)
+  {
+    struct vma *pv = p->vmas[i];
+    struct vma *v = kmem_cache_alloc(vmacache);
+    if (v == 0)
+      return -1;
+    acquire(&v->lock);
+    v->used = 1;
+    v->mfile = pv->mfile;
+    v->fd = pv->fd;
+    v->prot = pv->prot;
+    v->flags = pv->flags;
+    v->size = pv->size;
+    v->filesize = pv->filesize;
+    v->offset = pv->offset;
+    v->ip = pv->ip;
+    v->anon = pv->anon;
+    v->fawin = FAULTAROUND / 2;
+    v->fanext = 0;
+    v->advice = pv->advice;
+    v->addr = pv->addr;
+    if (vmainsert(np, v) < 0)
+    {
+      release(&v->lock);
+      kmem_cache_free(vmacache, v);
+      return -1;
+    }
+    if (v->mfile)
+      filedup(v->mfile);
+    if (v->anon)
+      anondup(v->anon);
+    for (int k = 0; k < PGROUNDUP(pv->size); k += PGSIZE)
+    {
+      uint64 phy = walkaddr(p->pagetable, pv->addr + k);
+      if (phy)
+      {
+        // private pages are shared copy-on-write.
+        int prot = vmaperm(pv);
+        if (pv->flags == MAP_PRIVATE && (prot & PTE_W))
+          prot = (prot & ~PTE_W) | PTE_COW;
+        // keep the dirty bit in both page tables, so that
+        // reclaim never drops a page that differs from its file.
+        pte_t *entry = walk(p->pagetable, pv->addr + k, 0);
+        int dirty = *entry & PTE_D;
+        if (mappages(np->pagetable, PGROUNDDOWN(v->addr + k), PGSIZE, phy, prot | PTE_U | dirty) < 0)
+        {
+          release(&v->lock);
+          return -1;
+        }
+        incref((void *)phy);
+        if (pv->flags == MAP_PRIVATE)
+        {
+          *entry = PA2PTE(phy) | prot | PTE_V | PTE_U | dirty;
+          uvmflushva(pv->addr + k);
+        }
+      }
+    }
+    release(&v->lock);
+  }
+  return 0;
+}
+
+// Drop the VMAs forkvmas() gave np before np could run. p
+// still maps the same pages and holds its own references to
+// the files and anon objects, so nothing is written back and
+// no segment is freed.
+static void
+forkvmafree(struct proc *np)
+{
+  struct vma *v;
+
+  while (np->nvma > 0)
+  {
+    v = np->vmas[np->nvma - 1];
+    for (int k = 0; k < PGROUNDUP(v->size); k += PGSIZE)
+      if (walkaddr(np->pagetable, v->addr + k))
+        uvmunmap(np->pagetable, v->addr + k, 1, 1);
+    if (v->anon)
+      anonput(v->anon);
+    if (v->mfile)
+      fileclose(v->mfile);
+    v->used = 0;
+    vmaremove(np, v);
+    kmem_cache_free(vmacache, v);
+  }
+}
+
 // Create a new process, copying the parent.
 // Sets up child kernel stack to return as if from fork() system call.
 int fork(void)
@@ -313,11 +437,11 @@ int fork(void)
     return -1;
   }
 
-  // Copy user memory from parent to child.
+  // Share user memory with the child, copy-on-write.
   allocvmaelf(np, p->text.size, p->text.filesize, p->text.ip, p->text.offset, p->text.addr, 1);
   allocvmaelf(np, p->data.size, p->data.filesize, p->data.ip, p->data.offset, p->data.addr, 0);
 
-  if (_uvmcopy(p->pagetable, np->pagetable, p->sz, PGROUNDUP(p->text.addr + p->text.size)) < 0)
+  if (uvmcopy(p->pagetable, np->pagetable, p->sz) < 0)
   {
     freeproc(np);
     release(&np->lock);
@@ -325,6 +449,16 @@ int fork(void)
   }
   np->sz = p->sz;
 
+  // child process inherits father's VMAs, at the same addresses
+  if (forkvmas(p, np) < 0)
+  {
+    printf("fork(): No memory for VMAs, pid=%d\n", p->pid);
+    forkvmafree(np);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
   // child process inherits tickets from father
   np->tickets = p->tickets;
 
@@ -344,75 +478,70 @@ int fork(void)
 
   pid = np->pid;
 
-  // child process inherits father's VMAs
-  for (i = 0; i < PER_PROCESS_VMAS; i++)
+  release(&np->lock);
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  np->state = RUNNABLE;
+  runqset(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// Create a process running the program at path, without
+// copying the caller first as fork() and exec() would.
+// The child's open files are the references in ofile, which
+// it takes over even on failure; it inherits the caller's
+// cwd and tickets. Returns the child's pid, or -1.
+int spawn(char *path, char **argv, struct file **ofile)
+{
+  int i, pid, argc;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if ((np = allocproc()) == 0)
+  {
+    for (i = 0; i < NOFILE; i++)
+      if (ofile[i])
+        fileclose(ofile[i]);
+    return -1;
+  }
+  np->tickets = p->tickets;
+  np->cwd = idup(p->cwd);
+  for (i = 0; i < NOFILE; i++)
+    np->ofile[i] = ofile[i];
+  memset(np->trapframe, 0, sizeof(*np->trapframe));
+  pid = np->pid;
+
+  // loading the program sleeps. np is USED and has no parent
+  // yet, so nothing else touches it without np->lock.
+  release(&np->lock);
+
+  if ((argc = execproc(np, path, argv)) < 0)
   {
-    if (p->vmas[i])
+    for (i = 0; i < NOFILE; i++)
     {
-      for (int j = 0; j < NVMAS; j++)
+      if (np->ofile[i])
       {
-        acquire(&vmas[j].lock);
-        if (!vmas[j].used)
-        {
-          np->vmas[i] = &vmas[j];
-          vmas[j].used = 1;
-          vmas[j].mfile = p->vmas[i]->mfile;
-          vmas[j].fd = p->vmas[i]->fd;
-          vmas[j].prot = p->vmas[i]->prot;
-          vmas[j].flags = p->vmas[i]->flags;
-          vmas[j].size = p->vmas[i]->size;
-          vmas[j].filesize = p->vmas[i]->filesize;
-          vmas[j].offset = p->vmas[i]->offset;
-          vmas[j].ip = p->vmas[i]->ip;
-          vmas[j].mfile->ref++;
-          np->nmp -= PGROUNDUP(vmas[j].size);
-          vmas[j].addr = np->nmp;
-          for (int k = 0; k < PGROUNDUP(p->vmas[i]->size); k += PGSIZE)
-          {
-
-            uint64 phy = walkaddr(p->pagetable, p->vmas[i]->addr + k);
-            if (phy)
-            {
-              int prot = 0;
-              switch (p->vmas[i]->prot)
-              {
-              case (PROT_READ):
-                prot = PTE_R;
-                break;
-              case (PROT_WRITE):
-                if (p->vmas[i]->flags != MAP_PRIVATE)
-                  prot = PTE_W;
-                break;
-              case (PROT_RW):
-                if (p->vmas[i]->flags != MAP_PRIVATE)
-                  prot = PTE_R | PTE_W;
-                else
-                  prot = PTE_R;
-                break;
-              default:
-                prot = 0;
-              }
-              if (mappages(np->pagetable, PGROUNDDOWN(vmas[j].addr + k), PGSIZE, phy, prot | PTE_U) < 0)
-              {
-                printf("fork(): Could not map physical to virtual address, pid=%d\n", np->pid);
-                setkilled(np);
-              }
-              if (p->vmas[i]->flags == MAP_PRIVATE)
-              {
-                pte_t *entry = walk(p->pagetable, p->vmas[i]->addr + k, 0);
-                *entry = PA2PTE(phy) | prot | PTE_V | PTE_U;
-              }
-              incref((void *)phy);
-            }
-          }
-          release(&vmas[j].lock);
-          break;
-        }
-        release(&vmas[j].lock);
+        fileclose(np->ofile[i]);
+        np->ofile[i] = 0;
       }
     }
+    begin_op();
+    iput(np->cwd);
+    end_op();
+    np->cwd = 0;
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
   }
-  release(&np->lock);
+  // the program's main(argc, argv).
+  np->trapframe->a0 = argc;
 
   acquire(&wait_lock);
   np->parent = p;
@@ -420,6 +549,7 @@ int fork(void)
 
   acquire(&np->lock);
   np->state = RUNNABLE;
+  runqset(np);
   release(&np->lock);
 
   return pid;
@@ -466,12 +596,27 @@ void exit(int status)
   _deallocvma(&(p->text));
   _deallocvma(&(p->data));
 
-  for (int i = 0; i < PER_PROCESS_VMAS; i++)
+  while (p->nvma > 0)
   {
-    if (p->vmas[i])
-      deallocvma(p->vmas[i]->addr, p->vmas[i]->size);
+    if (deallocvma(p->vmas[0]->addr, p->vmas[0]->size) < 0)
+      panic("exit: deallocvma");
   }
 
+  // Free user memory now, rather than leaving a large
+  // address space for the parent to free in wait().
+  pagetable_t pagetable;
+  uint64 sz;
+  acquire(&p->lock);
+  pagetable = p->pagetable;
+  sz = p->sz;
+  p->pagetable = 0;
+  p->sz = 0;
+  release(&p->lock);
+#ifdef SUMCOPY
+  kvmuser(p->kpagetable, 0);
+#endif
+  proc_freepagetable(pagetable, sz);
+
   begin_op();
   iput(p->cwd);
   end_op();
@@ -502,7 +647,7 @@ void exit(int status)
 int wait(uint64 addr)
 {
   struct proc *pp;
-  int havekids, pid;
+  int havekids, pid, xstate;
   struct proc *p = myproc();
 
   acquire(&wait_lock);
@@ -521,18 +666,15 @@ int wait(uint64 addr)
         havekids = 1;
         if (pp->state == ZOMBIE)
         {
-          // Found one.
+          // Found one. its status is copied out once the
+          // locks are released: the copy may sleep.
           pid = pp->pid;
-          if (addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-                                   sizeof(pp->xstate)) < 0)
-          {
-            release(&pp->lock);
-            release(&wait_lock);
-            return -1;
-          }
+          xstate = pp->xstate;
           freeproc(pp);
           release(&pp->lock);
           release(&wait_lock);
+          if (addr != 0 && copyout(p->pagetable, addr, (char *)&xstate, sizeof(xstate)) < 0)
+            return -1;
           return pid;
         }
         release(&pp->lock);
@@ -569,48 +711,37 @@ void scheduler(void)
 
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
-    int total_tickets = 0;
-    int total_ticks = 0;
-    for (p = proc; p < &proc[NPROC]; p++)
-    {
-      acquire(&p->lock);
-      total_ticks += p->ticks;
-      if (p->state == RUNNABLE)
-      {
-        total_tickets += p->tickets;
-      }
-      release(&p->lock);
-    }
 
-    if (total_tickets < 1)
+    // draw the winner among the RUNNABLE processes (runq.c).
+    if ((p = runqpick()) == 0)
     {
+      // nothing to run: use the idle time to pre-zero a free page.
+      kzero_idle();
       continue;
     }
 
-    int seed = total_tickets + total_ticks;
-    int random = randomrange(seed, 1, total_tickets);
-
-    for (p = proc; p < &proc[NPROC] && random > 0; p++)
+    acquire(&p->lock);
+    // another hart may have drawn it first.
+    if (p->state == RUNNABLE)
     {
-      acquire(&p->lock);
-      if (p->state == RUNNABLE)
-      {
-        if (random <= p->tickets)
-        {
-          // HAS BEEN SELECTED
-          p->state = RUNNING;
-          p->ticks++; /* ASSUMING 1 CLOCK TICK PER QUANTUM */
-          c->proc = p;
-          swtch(&c->context, &p->context);
-
-          // Process is done running for now.
-          // It should have changed its p->state before coming back.
-          c->proc = 0;
-        }
-        random -= p->tickets;
-      }
-      release(&p->lock);
+      // HAS BEEN SELECTED
+      p->state = RUNNING;
+      runqset(p);
+      p->ticks++; /* ASSUMING 1 CLOCK TICK PER QUANTUM */
+      c->proc = p;
+#ifdef SUMCOPY
+      kvmswitch(p->kpagetable);
+#endif
+      swtch(&c->context, &p->context);
+#ifdef SUMCOPY
+      kvmswitch(0);
+#endif
+
+      // Process is done running for now.
+      // It should have changed its p->state before coming back.
+      c->proc = 0;
     }
+    release(&p->lock);
   }
 }
 
@@ -646,6 +777,7 @@ void yield(void)
   struct proc *p = myproc();
   acquire(&p->lock);
   p->state = RUNNABLE;
+  runqset(p);
   sched();
   release(&p->lock);
 }
@@ -715,6 +847,7 @@ void wakeup(void *chan)
       if (p->state == SLEEPING && p->chan == chan)
       {
         p->state = RUNNABLE;
+        runqset(p);
       }
       release(&p->lock);
     }
@@ -738,6 +871,7 @@ int kill(int pid)
       {
         // Wake process from sleep().
         p->state = RUNNABLE;
+        runqset(p);
       }
       release(&p->lock);
       return 0;
@@ -846,41 +980,84 @@ int pinfo(uint64 ps)
   return 0;
 }
 
+// Map length bytes of f from offset, or anonymous memory if
+// f is 0, at addr if fixed (replacing whatever was mapped
+// there), else at addr if it is a free range, else wherever
+// there is room. Shared anonymous memory is a new anon object,
+// or a, taking a reference to it, if a is not 0 (shmat()).
+// Returns the address, or MAP_FAILED. A failed fixed mapping
+// leaves what was mapped there in place.
 uint64
-allocvma(int length, int prot, int flags, struct file *f, int fd, int offset)
+allocvma(uint64 addr, int length, int prot, int flags, struct file *f, int fd, int offset, int fixed, struct anon *a)
 {
   struct proc *p = myproc();
-  for (int i = 0; i < PER_PROCESS_VMAS; i++)
+  uint64 len = PGROUNDUP(length);
+  struct anon *an = a;
+  struct vma *v;
+
+  if (length <= 0)
+    return (uint64)MAP_FAILED;
+  if (fixed)
   {
-    if (!p->vmas[i])
-    {
-      for (int j = 0; j < NVMAS; j++)
-      {
-        acquire(&vmas[j].lock);
-        if (!vmas[j].used)
-        {
-          p->vmas[i] = &vmas[j];
-          vmas[j].used = 1;
-          vmas[j].mfile = f;
-          vmas[j].prot = prot;
-          vmas[j].flags = flags;
-          vmas[j].size = length;
-          vmas[j].filesize = length;
-          vmas[j].offset = offset;
-          vmas[j].fd = fd;
-          vmas[j].ip = f->ip;
-          vmas[j].mfile->ref++;
-          p->nmp -= PGROUNDUP(length);
-          vmas[j].addr = p->nmp;
-          release(&vmas[j].lock);
-          return vmas[j].addr;
-        }
-        release(&vmas[j].lock);
-      }
+    if (addr % PGSIZE || addr < PGROUNDUP(p->sz) || addr + len > TRAPFRAME)
       return (uint64)MAP_FAILED;
-    }
   }
-  return (uint64)MAP_FAILED;
+  else if (addr % PGSIZE || addr < PGROUNDUP(p->sz) || addr + len > TRAPFRAME ||
+           vmaoverlap(p, addr, addr + len))
+  {
+    if ((addr = vmagap(p, len)) == 0)
+      return (uint64)MAP_FAILED;
+  }
+
+  // whatever can fail comes before a fixed mapping replaces the
+  // old one: the VMA, its anon object, and room in the index for
+  // it and for the two VMAs deallocvma() may split at the ends.
+  if ((v = kmem_cache_alloc(vmacache)) == 0)
+    return (uint64)MAP_FAILED;
+  if (a)
+    anondup(a);
+  else if (f == 0 && flags == MAP_SHARED && (an = anonalloc(len / PGSIZE)) == 0)
+  {
+    kmem_cache_free(vmacache, v);
+    return (uint64)MAP_FAILED;
+  }
+  if (vmareserve(p, 3) < 0 ||
+      (fixed && vmaoverlap(p, addr, addr + len) && deallocvma(addr, len) < 0))
+  {
+    if (an)
+      anonput(an);
+    kmem_cache_free(vmacache, v);
+    return (uint64)MAP_FAILED;
+  }
+
+  acquire(&v->lock);
+  v->used = 1;
+  v->mfile = f;
+  v->prot = prot;
+  v->flags = flags;
+  v->size = length;
+  v->filesize = length;
+  v->offset = offset;
+  v->fd = fd;
+  v->ip = f ? f->ip : 0;
+  v->anon = an;
+  v->fawin = FAULTAROUND / 2;
+  v->fanext = 0;
+  v->advice = MADV_NORMAL;
+  v->addr = addr;
+  if (vmainsert(p, v) < 0)
+  {
+    if (v->anon)
+      anonput(v->anon);
+    v->used = 0;
+    release(&v->lock);
+    kmem_cache_free(vmacache, v);
+    return (uint64)MAP_FAILED;
+  }
+  if (f)
+    filedup(f);
+  release(&v->lock);
+  return v->addr;
 }
 
 void allocvmaelf(struct proc *p, int length, int filesz, struct inode *ip, int offset, uint64 vaddr, int text)
@@ -900,118 +1077,295 @@ void allocvmaelf(struct proc *p, int length, int filesz, struct inode *ip, int o
   vma->offset = offset;
   vma->ip = ip;
   vma->addr = vaddr;
+  vma->fawin = FAULTAROUND / 2;
+  vma->fanext = 0;
+  vma->advice = MADV_NORMAL;
   release(&vma->lock);
 }
 
+// Split vma at the page-aligned address at, which must be
+// inside it: vma keeps the part below at, and a new VMA with
+// its own references to the file or anon object takes the
+// rest. Returns the new VMA, or 0 if out of memory.
+static struct vma *
+splitvma(struct proc *p, struct vma *vma, uint64 at)
+{
+  struct vma *v = kmem_cache_alloc(vmacache);
+  int below = at - vma->addr;
+
+  if (v == 0)
+    return 0;
+  acquire(&v->lock);
+  v->used = 1;
+  v->mfile = vma->mfile;
+  v->fd = vma->fd;
+  v->ip = vma->ip;
+  v->anon = vma->anon;
+  v->prot = vma->prot;
+  v->flags = vma->flags;
+  v->addr = at;
+  v->size = vma->size - below;
+  v->filesize = vma->filesize > below ? vma->filesize - below : 0;
+  v->offset = vma->offset + below;
+  v->fawin = FAULTAROUND / 2;
+  v->fanext = 0;
+  v->advice = vma->advice;
+
+  vma->size = below;
+  if (vma->filesize > below)
+    vma->filesize = below;
+  if (vmainsert(p, v) < 0)
+  {
+    vma->size += v->size;
+    vma->filesize += v->filesize;
+    v->used = 0;
+    release(&v->lock);
+    kmem_cache_free(vmacache, v);
+    return 0;
+  }
+  if (v->mfile)
+    filedup(v->mfile);
+  if (v->anon)
+    anondup(v->anon);
+  release(&v->lock);
+  return v;
+}
+
+// Write the dirty pages of the shared file mapping vma in
+// [start, end) back to the file, and clear their PTE_D bits.
+// Clean pages are skipped, so syncing or unmapping a mapping
+// that was only read writes nothing. Dirty pages are packed
+// into as few log transactions as MAXOPBLOCKS allows, one
+// block of each being the inode that writei() updates.
+// Writes stop at the end of the mapping and of the file,
+// which a store to the mapping cannot grow.
+static void
+vmawriteback(struct proc *p, struct vma *vma, uint64 start, uint64 end)
+{
+  uint64 vmaend = vma->addr + vma->size;
+  int inop = 0, nblocks = 0;
+  pte_t *pte;
+
+  for (uint64 va = start; va < end && va < vmaend; va += PGSIZE)
+  {
+    pte = walk(p->pagetable, va, 0);
+    if (pte == 0 || (*pte & (PTE_V | PTE_D)) != (PTE_V | PTE_D))
+      continue;
+
+    if (inop && nblocks + PGSIZE / BSIZE > MAXOPBLOCKS - 1)
+    {
+      iunlock(vma->ip);
+      end_op();
+      inop = 0;
+    }
+    if (!inop)
+    {
+      begin_op();
+      ilock(vma->ip);
+      inop = 1;
+      nblocks = 0;
+    }
+
+    uint off = vma->offset + (va - vma->addr);
+    uint n = PGSIZE;
+    if (n > vmaend - va)
+      n = vmaend - va;
+    if (off >= vma->ip->size)
+      n = 0;
+    else if (n > vma->ip->size - off)
+      n = vma->ip->size - off;
+    if (n > 0 && writei(vma->ip, 1, va, off, n) != n)
+    {
+      printf("vmawriteback(): write failed, pid=%d\n", p->pid);
+      continue;
+    }
+    *pte &= ~PTE_D;
+    uvmflushva(va);
+    nblocks += (n + BSIZE - 1) / BSIZE;
+  }
+  if (inop)
+  {
+    iunlock(vma->ip);
+    end_op();
+  }
+}
+
+// Unmap all of vma: write back the dirty pages of a shared
+// file mapping, free the pages, drop the file or anon object.
+static void
+freevma(struct proc *p, struct vma *vma)
+{
+  vma->used = 0;
+  if (vma->flags == MAP_SHARED && vma->ip)
+    vmawriteback(p, vma, vma->addr, vma->addr + vma->size);
+  for (int j = 0; j < PGROUNDUP(vma->size); j += PGSIZE)
+  {
+    uint64 phy_addr = walkaddr(p->pagetable, vma->addr + j);
+    if (phy_addr)
+      uvmunmap(p->pagetable, vma->addr + j, 1, 1);
+  }
+
+  // with only the segment table's reference left, a shared
+  // memory segment has lost its last attacher.
+  if (vma->anon && anonput(vma->anon) == 1)
+    shmrelease(vma->anon);
+  if (vma->mfile)
+    fileclose(vma->mfile);
+  vmaremove(p, vma);
+  kmem_cache_free(vmacache, vma);
+}
+
+// Unmap [addr, addr+size) of the current process, splitting
+// the VMAs that are only partly in the range. Returns 0, or
+// -1 if nothing was mapped there or a split failed.
 int deallocvma(uint64 addr, int size)
 {
   struct proc *p = myproc();
-  for (int i = 0; i < PER_PROCESS_VMAS; i++)
+  uint64 end = addr + PGROUNDUP(size);
+  struct vma *vma;
+  int found = 0;
+
+  // split at both ends before unmapping anything, so that a
+  // failed split leaves the range as it was.
+  if ((vma = vmaoverlap(p, addr, end)) != 0 && vma->addr < addr &&
+      splitvma(p, vma, addr) == 0)
+    return -1;
+  if ((vma = findvma(p, end - 1)) != 0 && vma->addr + vma->size > end &&
+      splitvma(p, vma, end) == 0)
+    return -1;
+
+  while ((vma = vmaoverlap(p, addr, end)) != 0)
   {
-    if (p->vmas[i] && p->vmas[i]->used && (addr >= p->vmas[i]->addr) && (addr < p->vmas[i]->addr + p->vmas[i]->size))
+    freevma(p, vma);
+    found = 1;
+  }
+  return found ? 0 : -1;
+}
+
+// Write the dirty pages of shared file mappings in
+// [addr, addr+len) of the current process back to their
+// files, for msync(). The range must be mapped throughout.
+// With MS_ASYNC nothing is written now: the pages stay dirty
+// and go out with a later MS_SYNC, munmap() or exit(), which
+// is all an asynchronous writeback could promise.
+// Returns 0 or -1.
+int msyncvma(uint64 addr, int len, int flags)
+{
+  struct proc *p = myproc();
+  uint64 end = addr + PGROUNDUP(len);
+  struct vma *vma;
+  uint64 a;
+
+  for (a = addr; a < end; a = PGROUNDUP(vma->addr + vma->size))
+    if ((vma = findvma(p, a)) == 0)
+      return -1;
+  if (flags & MS_ASYNC)
+    return 0;
+
+  for (a = addr; a < end; a = PGROUNDUP(vma->addr + vma->size))
+  {
+    vma = findvma(p, a);
+    if (vma->flags == MAP_SHARED && vma->ip)
+      vmawriteback(p, vma, a, end);
+  }
+  return 0;
+}
+
+// Apply advice to [addr, addr+len) of the current process,
+// which must be mapped throughout, for madvise().
+// MADV_NORMAL, MADV_RANDOM and MADV_SEQUENTIAL are kept in the
+// VMAs, split as needed, for faultwindow() to use.
+// MADV_WILLNEED faults the file pages of the range in now,
+// while free memory lasts; there is no kernel thread to do it
+// in the background, but each fault reads a whole window with
+// one disk request. MADV_DONTNEED unmaps the range's pages, so
+// that the next touch faults: dirty shared file pages are
+// written back first, and private changes are lost.
+// Returns 0 or -1.
+int madvisevma(uint64 addr, int len, int advice)
+{
+  struct proc *p = myproc();
+  uint64 end = addr + PGROUNDUP(len);
+  struct vma *vma;
+  uint64 a, va, vend;
+  pte_t *pte;
+  int saved;
+
+  for (a = addr; a < end; a = PGROUNDUP(vma->addr + vma->size))
+    if ((vma = findvma(p, a)) == 0)
+      return -1;
+
+  for (a = addr; a < end; a = vend)
+  {
+    vma = findvma(p, a);
+    vend = PGROUNDUP(vma->addr + vma->size);
+    if (vend > end)
+      vend = end;
+    switch (advice)
     {
-      // Unmap complete VMA
-      int complete = 0;
-      int new_offset = p->vmas[i]->offset;
-      if (addr == p->vmas[i]->addr && size == p->vmas[i]->size)
-      {
-        p->vmas[i]->used = 0;
-        // fileclose cierra la ultima referencia del fichero correctamente
-        complete = 1;
-      }
-      // Unmap first part of VMA
-      else if (addr == p->vmas[i]->addr && size < p->vmas[i]->size)
-      {
-        p->vmas[i]->addr += size;
-        p->vmas[i]->size -= size;
-        new_offset = p->vmas[i]->offset + size;
-      }
-      // Unmap last part of the VMA
-      else if (addr > p->vmas[i]->addr && (addr + size == p->vmas[i]->addr + p->vmas[i]->size))
+    case MADV_WILLNEED:
+      // as NORMAL, so that MADV_SEQUENTIAL does not drop
+      // behind what is being read in.
+      saved = vma->advice;
+      vma->advice = MADV_NORMAL;
+      for (va = a; va < vend && vma->ip; va += PGSIZE)
       {
-        p->vmas[i]->size -= size;
+        if (kfreepages() < 2 * NRECLAIM || killed(p))
+          break;
+        if ((pte = walk(p->pagetable, va, 0)) == 0 || (*pte & PTE_V) == 0)
+          allocPhysicalVMA(vma, p, va, vmaperm(vma) | PTE_U, 0);
       }
-      else
+      vma->advice = saved;
+      break;
+    case MADV_DONTNEED:
+      if (vma->flags == MAP_SHARED && vma->ip)
+        vmawriteback(p, vma, a, vend);
+      uvmunmap(p->pagetable, a, (vend - a) / PGSIZE, 1);
+      vma->fanext = 0;
+      break;
+    default:
+      if (vma->addr < a && (vma = splitvma(p, vma, a)) == 0)
         return -1;
-      if (p->vmas[i]->flags == MAP_SHARED)
-      {
-        int max = ((MAXOPBLOCKS - 1 - 1 - 2) / 2) * BSIZE;
-        int j = 0;
-        while (j < size)
-        {
-          int n1 = size - j;
-          if (n1 > max)
-            n1 = max;
-
-          if (!(walkaddr(p->pagetable, addr + j)))
-          {
-            j += PGSIZE;
-            continue;
-          }
-
-          begin_op();
-          ilock(p->vmas[i]->ip);
-          int w = 0;
-          while (w < PGSIZE)
-          {
-            int r = writei(p->vmas[i]->ip, 1, addr + j + w, p->vmas[i]->offset + j + w, n1);
-            w += r;
-            n1 = PGSIZE - w;
-            if (n1 > max)
-              n1 = max;
-          }
-          if (getref((void *)walkaddr(p->pagetable, addr + j)) == 1)
-            uvmunmap(p->pagetable, addr + j, 1, 1);
-          else
-          {
-            decref((void*)walkaddr(p->pagetable, addr+j));
-            uvmunmap(p->pagetable, addr + j, 1, 0);
-          }
-          iunlock(p->vmas[i]->ip);
-          end_op();
-          j += w;
-        }
-      }
-      else
-      {
-        for (int j = 0; j < PGROUNDUP(size); j += PGSIZE)
-        {
-          uint64 phy_addr = walkaddr(p->pagetable, addr + j);
-          if (phy_addr)
-          {
-            if (getref((void *)phy_addr) == 1)
-              uvmunmap(p->pagetable, addr + j, 1, 1);
-            else
-              uvmunmap(p->pagetable, addr + j, 1, 0);
-          }
-        }
-      }
-      p->vmas[i]->offset = new_offset;
+      if (vma->addr + vma->size > end && splitvma(p, vma, end) == 0)
+        return -1;
+      vma->advice = advice;
+      break;
+    }
+  }
+  return 0;
+}
 
-      if (complete)
-      {
-        if (p->vmas[i]->mfile->ref == 1)
-        {
-          fileclose(p->vmas[i]->mfile);
-          p->ofile[p->vmas[i]->fd] = 0;
-        }
-        else
-          p->vmas[i]->mfile->ref--;
+// Change the protection of [addr, addr+len) of the current
+// process, which must be mapped throughout, to prot, splitting
+// VMAs as needed. Returns 0 or -1.
+int mprotectvma(uint64 addr, int len, int prot)
+{
+  struct proc *p = myproc();
+  uint64 end = addr + PGROUNDUP(len);
+  struct vma *vma;
+  uint64 a;
 
-        p->vmas[i] = 0;
-      }
+  // check all of the range before changing any of it.
+  for (a = addr; a < end; a = PGROUNDUP(vma->addr + vma->size))
+  {
+    if ((vma = findvma(p, a)) == 0)
+      return -1;
+    if (vma->flags == MAP_SHARED && vma->mfile && (prot & PROT_WRITE) && !vma->mfile->writable)
+      return -1;
+  }
 
-      uint64 min_vma = TRAPFRAME;
-      for (int v = 0; v < PER_PROCESS_VMAS; v++)
-      {
-        if (p->vmas[v] && p->vmas[v]->addr < min_vma)
-          min_vma = p->vmas[v]->addr;
-      }
-      p->nmp = min_vma;
-      return 0;
-    }
+  for (a = addr; a < end; a = PGROUNDUP(vma->addr + vma->size))
+  {
+    vma = findvma(p, a);
+    if (vma->addr < a && (vma = splitvma(p, vma, a)) == 0)
+      return -1;
+    if (vma->addr + vma->size > end && splitvma(p, vma, end) == 0)
+      return -1;
+    vma->prot = prot;
+    uvmprotect(p->pagetable, vma->addr, PGROUNDUP(vma->size) / PGSIZE,
+               vmaperm(vma), vma->flags == MAP_PRIVATE);
   }
-  return -1;
+  return 0;
 }
 
 void _deallocvma(struct vma* vma)
@@ -1,3 +1,5 @@
+#include "faultstat.h"
+
 // Saved registers for kernel context switches.
 struct context {
   uint64 ra;
@@ -23,13 +25,17 @@ struct vma {
   int used;                 // boolean field to check if is used
   struct file* mfile;       // file mapped to process' virtual address space
   int fd;                   // file descriptor
-  struct inode* ip;         // inode for text and data VMAs
+  struct inode* ip;         // inode for text and data VMAs, 0 if anonymous
+  struct anon* anon;        // pages of a shared anonymous VMA
   uint64 addr;              // Address were the mapped file begins 
   int prot;                 // Protections associated to the file
   int flags;                // Flags associated to the file
   int size;                 // size of the file. It could not be equal to the file in disk size.
   int filesize;             // size of data inside file.
   int offset;               // We assume it is 0.
+  int fawin;                // fault-around window, in pages
+  uint64 fanext;            // first page after the last fault-around
+  int advice;               // MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL
 };
 
 // Per-CPU state.
@@ -38,6 +44,9 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation the TLB was last flushed for.
+  uint64 rngstate;            // random() generator state (random.c).
+  uint64 rnginc;              // its stream: odd, different on each hart.
 };
 
 extern struct cpu cpus[NCPU];
@@ -91,6 +100,7 @@ struct trapframe {
   /* 264 */ uint64 t4;
   /* 272 */ uint64 t5;
   /* 280 */ uint64 t6;
+  /* 288 */ uint64 kernel_flush;  // flush the TLB on entry: no ASIDs
 };
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
@@ -106,15 +116,17 @@ struct proc {
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
 
-  uint64 nmp;                   // next pointer to VMA
-
   // VMAS
-  struct vma* vmas[PER_PROCESS_VMAS];
+  struct vma** vmas;           // mmap VMAs sorted by address (vma.c)
+  int nvma;                    // entries in vmas
+  int vmaorder;                // vmas is 2^vmaorder pages
+  struct vma* lastvma;         // last VMA findvma() returned
   struct vma text;
   struct vma data;
 
   // PAGE FAULTS
   int page_faults;
+  struct faultstat faults;      // by type, with latencies (faultstat.c)
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
@@ -127,6 +139,9 @@ struct proc {
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
+  pagetable_t kpagetable;      // Kernel page table with a user alias (SUMCOPY)
+  uint64 asid;                 // ASID of pagetable, with its generation (asid.c)
+  int asidcpu;                 // hart that last ran with that ASID
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
@@ -1,30 +1,66 @@
 #include "param.h"
 #include "types.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
 
-#define NROUNDS 10
+// Random numbers for the lottery scheduler: a PCG32 generator
+// (O'Neill, "PCG: A Family of Simple Fast Space-Efficient
+// Statistically Good Algorithms for Random Number Generation")
+// per hart, each on its own stream, so harts drawing at the
+// same moment do not draw the same numbers and never share
+// state. The caller must have interrupts off, so that it stays
+// on its hart.
 
+#define PCG_MULT 6364136223846793005ULL
+
+// Seed this hart's generator from the time and its hart id.
+void
+randominit(void)
+{
+  struct cpu *c = mycpu();
+
+  c->rnginc = ((uint64)cpuid() << 1) | 1;
+  c->rngstate = 0;
+  random();
+  c->rngstate += r_time();
+  random();
+}
+
+// Return 32 random bits.
 uint
-random(int seed)
+random(void)
 {
-  int a = 1103515245, c = 12345, m = 32768;
-  int xn = seed;
-  int xn1;
-  for (int i = 0; i < NROUNDS; i++) {
-    xn1 = (a * xn + c) % m;
-    xn = xn1;
-  }
-  return xn;
+  struct cpu *c = mycpu();
+  uint64 old = c->rngstate;
+  uint xorshifted, rot;
+
+  c->rngstate = old * PCG_MULT + c->rnginc;
+  xorshifted = ((old >> 18) ^ old) >> 27;
+  rot = old >> 59;
+  return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
 }
 
-// Return a random integer between a given range.
+// Return a random integer between lo and hi, inclusive, every
+// value equally likely: outputs below 2^32 mod range, which
+// would make the low values more likely, are drawn again.
 int
-randomrange(int seed, int lo, int hi)
+randomrange(int lo, int hi)
 {
   if (hi < lo) {
     int tmp = lo;
     lo = hi;
     hi = tmp;
   }
-  int range = hi - lo + 1;
-  return random(seed) % (range) + lo;
+  uint range = (uint)(hi - lo) + 1;
+  uint threshold, r;
+
+  if (range == 0)
+    return lo + random();
+  threshold = -range % range;
+  do {
+    r = random();
+  } while (r < threshold);
+  return lo + r % range;
 }
@@ -0,0 +1,295 @@
+// Page reclaim.
+//
+// When free memory runs low, reclaim() sweeps a clock hand
+// over the memory of user processes. A page whose PTE_A bit
+// is set has been used since the hand last passed: the hand
+// clears the bit and gives the page a second chance. Other
+// pages are freed in one of two ways:
+//
+//  - file-backed pages (text, data and mmap) whose PTE_D bit
+//    is clear still hold exactly what allocPhysicalVMA() read
+//    from the file (or zeroes, past the end of it), so they are
+//    simply unmapped and read again on the next fault. So are
+//    clean pages of anonymous mmap VMAs, which are still zero.
+//  - anonymous pages (heap, stack and dirty data, between the
+//    end of the text and p->sz) are written to swap in clusters
+//    of up to SWAPCLUSTER pages; see swap.c.
+//
+// Only pages mapped by a single page table are freed, since
+// a shared page would have to be unmapped everywhere. A page
+// shared only with the page cache is unmapped as well, and
+// freed by pcache_shrink(), which also frees cached pages
+// that no process maps before the hand starts. And only
+// from processes that cannot be holding a physical address
+// returned by walkaddr(): sleeping processes and the caller
+// itself. The kernel never sleeps between walkaddr() and using
+// its result. The copy functions in vm.c can sleep in the
+// middle of a copy, in check_vmas() (swapin(), reading a file,
+// reclaim()), but they walk the page table again after it and
+// hold no physical address across the call. A runnable process
+// may have been preempted in the middle of copyout(), so it is
+// skipped.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+
+#define RECLAIM_LOW 64   // reclaim on a fault below this many free pages
+
+extern struct proc proc[NPROC];
+
+// The clock hand: process, region (0 text, 1 anonymous
+// memory and data, 2.. mmap VMAs) and page offset within it.
+struct {
+  struct spinlock lock;
+  int pidx;
+  int vidx;
+  uint64 off;
+} hand;
+
+// Anonymous pages taken out of their page tables, to be
+// written to the reserved swap slots slot..slot+nslot-1.
+struct cluster {
+  int slot;
+  int nslot;
+  int n;
+  char *pages[SWAPCLUSTER];
+};
+
+void
+reclaiminit(void)
+{
+  initlock(&hand.lock, "reclaim");
+}
+
+// Look at the file-backed page mapped at va, which belongs
+// to vma if that is a region the page cache serves.
+// Returns 1 if it was evicted and freed.
+static int
+evict(pagetable_t pagetable, uint64 va, struct vma *vma)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint ref;
+
+  if ((pte = walk(pagetable, va, 0)) == 0)
+    return 0;
+  if ((*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U))
+    return 0;
+  if (*pte & PTE_A)
+  {
+    // recently used: second chance.
+    *pte &= ~PTE_A;
+    return 0;
+  }
+  if (*pte & PTE_D)
+    return 0;
+  pa = PTE2PA(*pte);
+  ref = getref((void *)pa);
+  // a page shared only with the page cache can be unmapped;
+  // pcache_shrink() frees it once nothing maps it.
+  if (ref != 1 &&
+      !(ref == 2 && vma &&
+        pcache_has(vma->ip->dev, vma->ip->inum, PGROUNDDOWN(va - vma->addr) + vma->offset, (char *)pa)))
+    return 0;
+  *pte = 0;
+  kput((void *)pa);
+  return ref == 1;
+}
+
+// Look at the anonymous page mapped at va, and if it should
+// go, replace its PTE with a swap entry for the next slot of
+// c and add the page to c. Returns 1 if the page was taken.
+static int
+swapout(pagetable_t pagetable, uint64 va, struct cluster *c)
+{
+  pte_t *pte;
+  uint64 pa;
+
+  if ((pte = walk(pagetable, va, 0)) == 0)
+    return 0;
+  if ((*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U))
+    return 0;
+  if (*pte & PTE_A)
+  {
+    *pte &= ~PTE_A;
+    return 0;
+  }
+  pa = PTE2PA(*pte);
+  if (getref((void *)pa) != 1)
+    return 0;
+
+  if (c->nslot == 0)
+  {
+    // reserve slots for as big a cluster as swap has room for.
+    for (int k = SWAPCLUSTER; k > 0 && c->nslot == 0; k /= 2)
+      if ((c->slot = swapalloc(k)) >= 0)
+        c->nslot = k;
+    if (c->nslot == 0)
+      return 0;
+  }
+
+  *pte = SLOT2PTE(c->slot + c->n) | (PTE_FLAGS(*pte) & ~(PTE_V | PTE_A | PTE_D)) | PTE_SWAP;
+  c->pages[c->n++] = (char *)pa;
+  return 1;
+}
+
+static struct vma *
+handvma(struct proc *p, int vidx)
+{
+  struct vma *vma;
+
+  if (vidx == 0)
+    vma = &p->text;
+  else if (vidx - 2 < p->nvma)
+    vma = p->vmas[vidx - 2];
+  else
+    return 0;
+  if (vma == 0 || !vma->used)
+    return 0;
+  return vma;
+}
+
+// Advance the hand over p's memory until *freed plus the
+// pages in c reach n, c is full, or p is done. Evicted pages
+// are counted in *freed. Returns 1 if it stopped before the
+// end of p. Caller holds hand.lock and p->lock.
+static int
+reclaimproc(struct proc *p, int n, int *freed, struct cluster *c)
+{
+  struct vma *vma, *cached;
+  uint64 start, end, va;
+  pte_t *pte;
+
+  for (; hand.vidx < 2 + p->nvma; hand.vidx++, hand.off = 0)
+  {
+    if (hand.vidx == 1)
+    {
+      start = PGROUNDUP(p->text.addr + p->text.size);
+      end = PGROUNDUP(p->sz);
+    }
+    else
+    {
+      if ((vma = handvma(p, hand.vidx)) == 0)
+        continue;
+      cached = vma;
+      if (hand.vidx > 1 && (vma->flags != MAP_PRIVATE || vma->ip == 0))
+        cached = 0;  // not served by the page cache
+      start = PGROUNDDOWN(vma->addr);
+      end = PGROUNDUP(vma->addr + vma->size);
+    }
+    for (; start + hand.off < end; hand.off += PGSIZE)
+    {
+      va = start + hand.off;
+      if (hand.vidx != 1)
+      {
+        *freed += evict(p->pagetable, va, cached);
+      }
+      else if (megapte(p->pagetable, va))
+      {
+        // megapages stay put; skip to the end of this one.
+        hand.off += MEGAPGSIZE - (va & (MEGAPGSIZE - 1)) - PGSIZE;
+        continue;
+      }
+      else if ((pte = walk(p->pagetable, va, 0)) == 0)
+      {
+        continue;
+      }
+      else if (p->data.used && va >= p->data.addr && va < p->data.addr + p->data.size &&
+               !(*pte & PTE_D))
+      {
+        // clean data: still as read from the executable.
+        *freed += evict(p->pagetable, va, 0);
+      }
+      else
+      {
+        swapout(p->pagetable, va, c);
+      }
+      if (*freed + c->n >= n || (c->nslot && c->n == c->nslot))
+      {
+        hand.off += PGSIZE;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Try to free n user pages, by evicting clean file-backed
+// pages and swapping out anonymous ones. Gives up after the
+// hand has gone round twice, since the first sweep may only
+// clear PTE_A bits. Returns the number of pages freed.
+int
+reclaim(int n)
+{
+  struct proc *p, *me = myproc();
+  struct cluster c;
+  int freed, more;
+
+  // pages no process maps any more are the cheapest to free.
+  freed = pcache_shrink(n);
+
+  for (int i = 0; i <= 2 * NPROC && freed < n;)
+  {
+    c.n = c.nslot = 0;
+    more = 0;
+
+    acquire(&hand.lock);
+    p = &proc[hand.pidx];
+    acquire(&p->lock);
+    if ((p->state == SLEEPING || p == me) && p->pagetable)
+    {
+      more = reclaimproc(p, n - freed, &freed, &c);
+      // its TLB entries may now be stale, on whichever hart
+      // it last ran; see asid.c.
+      if (p != me)
+        asidforget(p);
+    }
+    release(&p->lock);
+    if (!more)
+    {
+      hand.pidx = (hand.pidx + 1) % NPROC;
+      hand.vidx = 0;
+      hand.off = 0;
+      i++;
+    }
+    release(&hand.lock);
+
+    // the I/O sleeps, so it happens without any locks held.
+    for (int k = c.n; k < c.nslot; k++)
+    {
+      swapfree(c.slot + k);
+      swapdone(c.slot + k, 1);
+    }
+    if (c.n > 0)
+    {
+      swapwrite(c.slot, c.pages, c.n);
+      for (int k = 0; k < c.n; k++)
+        kput(c.pages[k]);
+      freed += c.n;
+    }
+  }
+  // and the cached pages that evict() just unmapped.
+  if (freed < n)
+    freed += pcache_shrink(n - freed);
+  // and the caller's own, here.
+  sfence_vma();
+  return freed;
+}
+
+// Called on the page-fault path before allocating:
+// evict some pages if free memory is running low.
+void
+reclaim_check(void)
+{
+  if (kfreepages() < RECLAIM_LOW)
+    reclaim(NRECLAIM);
+}
@@ -0,0 +1,97 @@
+// Lottery run queue.
+//
+// The tickets of the RUNNABLE processes are kept in a Fenwick
+// tree indexed by proc[] slot, so the scheduler draws a winner
+// in O(log NPROC) without touching any p->lock but the
+// winner's. Every other process weighs 0 in the tree.
+//
+// runqset() brings a process's weight up to date; it is called
+// with p->lock held after each change of p->state or
+// p->tickets. The tree itself is protected by runq.lock, which
+// is taken after p->lock and never the other way round, so
+// runqpick() cannot lock the process it draws: it returns it
+// unlocked, and the scheduler checks it is still RUNNABLE once
+// it holds p->lock, since another hart may have drawn it too.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+struct {
+  struct spinlock lock;
+  int tree[NPROC + 1];   // Fenwick tree of weights, 1-based
+  int weight[NPROC];     // weight of each slot; written with its p->lock held
+  int total;             // sum of weight[]
+} runq;
+
+extern struct proc proc[NPROC];
+
+// The highest power of two not above NPROC.
+static int
+runqtop(void)
+{
+  int top = 1;
+
+  while (top * 2 <= NPROC)
+    top *= 2;
+  return top;
+}
+
+void
+runqinit(void)
+{
+  initlock(&runq.lock, "runq");
+}
+
+// Make p's weight its tickets if it is RUNNABLE, 0 otherwise.
+// Caller holds p->lock.
+void
+runqset(struct proc *p)
+{
+  int i = p - proc;
+  int w = p->state == RUNNABLE ? p->tickets : 0;
+  int delta = w - runq.weight[i];
+
+  if (delta == 0)
+    return;
+  acquire(&runq.lock);
+  runq.weight[i] = w;
+  runq.total += delta;
+  for (i++; i <= NPROC; i += i & -i)
+    runq.tree[i] += delta;
+  release(&runq.lock);
+}
+
+// Draw a process with probability proportional to its tickets
+// among the RUNNABLE ones. Returns it unlocked, or 0 if there
+// is none.
+struct proc *
+runqpick(void)
+{
+  int i = 0, r;
+
+  acquire(&runq.lock);
+  if (runq.total < 1)
+  {
+    release(&runq.lock);
+    return 0;
+  }
+  r = randomrange(1, runq.total);
+
+  // the slot whose prefix sum first reaches r.
+  for (int step = runqtop(); step > 0; step /= 2)
+  {
+    if (i + step <= NPROC && runq.tree[i + step] < r)
+    {
+      i += step;
+      r -= runq.tree[i];
+    }
+  }
+  release(&runq.lock);
+
+  return &proc[i];
+}
@@ -0,0 +1,182 @@
+// System V style shared memory segments.
+//
+// A segment is an anon object (anon.c) in the segment table,
+// which holds one reference to it. shmget() finds or creates
+// one by key, shmat() maps it into the caller as a shared
+// anonymous VMA holding another reference, and fork() gives
+// the child its own. The pages are allocated on first touch,
+// are the same physical pages in every process the segment
+// is attached to, and never go near the file system.
+//
+// When the last attachment goes away (shmdt(), munmap() or
+// exit()) freevma() sees the table's reference alone is left
+// and calls shmrelease(), which frees the segment. A segment
+// that has never been attached stays until it is.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fcntl.h"
+
+struct shmseg {
+  int key;
+  int id;               // returned by shmget(): seq * NSHM + slot
+  uint64 size;          // bytes, a multiple of PGSIZE
+  struct anon *anon;    // 0 if the slot is free
+};
+
+struct {
+  struct spinlock lock;
+  struct shmseg seg[NSHM];
+  int seq;
+} shm;
+
+void
+shminit(void)
+{
+  initlock(&shm.lock, "shm");
+}
+
+// Caller holds shm.lock.
+static struct shmseg *
+shmfind(int id)
+{
+  struct shmseg *s;
+
+  if (id < 0)
+    return 0;
+  s = &shm.seg[id % NSHM];
+  if (s->anon == 0 || s->id != id)
+    return 0;
+  return s;
+}
+
+// Return the id of the segment with key, creating one of size
+// bytes if there is none and flags has IPC_CREAT. IPC_PRIVATE
+// always creates a new segment. Returns -1 if there is no
+// such segment, IPC_EXCL was given and there is one, or it is
+// smaller than size; or if out of segments or memory.
+int
+shmget(int key, uint64 size, int flags)
+{
+  struct shmseg *s, *free = 0;
+  struct anon *a;
+  int id;
+
+  size = PGROUNDUP(size);
+  acquire(&shm.lock);
+  for (s = shm.seg; s < &shm.seg[NSHM]; s++)
+  {
+    if (s->anon == 0)
+    {
+      if (free == 0)
+        free = s;
+    }
+    else if (key != IPC_PRIVATE && s->key == key)
+    {
+      id = s->id;
+      if ((flags & (IPC_CREAT | IPC_EXCL)) == (IPC_CREAT | IPC_EXCL) || size > s->size)
+        id = -1;
+      release(&shm.lock);
+      return id;
+    }
+  }
+  if ((key != IPC_PRIVATE && !(flags & IPC_CREAT)) || free == 0 ||
+      size == 0 || size >= TRAPFRAME || (a = anonalloc(size / PGSIZE)) == 0)
+  {
+    release(&shm.lock);
+    return -1;
+  }
+  free->key = key;
+  free->id = shm.seq++ % (0x7fffffff / NSHM) * NSHM + (free - shm.seg);
+  free->size = size;
+  free->anon = a;
+  id = free->id;
+  release(&shm.lock);
+  return id;
+}
+
+// Attach segment id to the calling process, at addr if that
+// is a free range, else wherever there is room; read-only if
+// flags has SHM_RDONLY. Returns the address, or MAP_FAILED.
+uint64
+shmat(int id, uint64 addr, int flags)
+{
+  struct shmseg *s;
+  struct anon *a;
+  uint64 size, va;
+  int prot = (flags & SHM_RDONLY) ? PROT_READ : PROT_RW;
+
+  acquire(&shm.lock);
+  if ((s = shmfind(id)) == 0)
+  {
+    release(&shm.lock);
+    return (uint64)MAP_FAILED;
+  }
+  // a reference of our own keeps the segment from being
+  // freed before the new VMA has its reference.
+  a = s->anon;
+  size = s->size;
+  anondup(a);
+  release(&shm.lock);
+
+  va = allocvma(addr, size, prot, MAP_SHARED, 0, -1, 0, 0, a);
+  anonput(a);
+  return va;
+}
+
+// Detach the segment attached at addr from the calling
+// process. Returns 0, or -1 if no segment starts at addr.
+// What is left of the attachment may be less than the segment,
+// or split by mprotect(): only the run of VMAs from addr that
+// map consecutive pages of it goes, never whatever munmap()
+// and a later mmap() put in a hole.
+int
+shmdt(uint64 addr)
+{
+  struct proc *p = myproc();
+  struct vma *v, *w;
+  struct shmseg *s;
+  uint64 size = 0, end;
+
+  if ((v = findvma(p, addr)) == 0 || v->addr != addr || v->anon == 0)
+    return -1;
+  acquire(&shm.lock);
+  for (s = shm.seg; s < &shm.seg[NSHM]; s++)
+    if (s->anon == v->anon)
+      size = s->size;
+  release(&shm.lock);
+  if (size == 0)
+    return -1;
+
+  end = PGROUNDUP(v->addr + v->size);
+  while (end - addr < size && (w = findvma(p, end)) != 0 && w->addr == end &&
+         w->anon == v->anon && w->offset == v->offset + (end - addr))
+    end = PGROUNDUP(w->addr + w->size);
+  return deallocvma(addr, end - addr);
+}
+
+// Called by freevma() when a's last mapping goes: if a is a
+// segment and still has no other reference, free it.
+void
+shmrelease(struct anon *a)
+{
+  struct shmseg *s;
+
+  acquire(&shm.lock);
+  for (s = shm.seg; s < &shm.seg[NSHM]; s++)
+  {
+    if (s->anon == a && anonref(a) == 1)
+    {
+      s->anon = 0;
+      release(&shm.lock);
+      anonput(a);
+      return;
+    }
+  }
+  release(&shm.lock);
+}
@@ -0,0 +1,214 @@
+// Object caches for small, fixed-size kernel structures
+// (pipes, open files, VMAs, in-memory inodes).
+//
+// Each cache carves pages from kalloc() into slabs of
+// equal-sized objects. A slab page starts with a struct slab
+// header, followed by a stack of the indexes of its free
+// objects, followed by the objects themselves. Keeping the
+// free list outside the objects means an object keeps the
+// state its constructor gave it (e.g. an initialized lock)
+// across free and reallocation.
+//
+// Each hart has a small magazine of recently freed objects
+// per cache, so most kmem_cache_alloc()/kmem_cache_free()
+// calls touch no lock at all; the cache lock is only taken
+// to move objects between a magazine and the slabs.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NCACHE 8      // caches in the system
+#define KMAG   8      // objects in a hart's magazine
+
+struct slab {
+  struct slab *next;          // on the cache's partial list
+  struct kmem_cache *cache;
+  int inuse;                  // objects handed out or in a magazine
+  int nfree;                  // entries on free[]
+  ushort free[];              // indexes of free objects
+};
+
+struct kmem_cache {
+  char *name;
+  uint size;                  // object stride
+  uint nobj;                  // objects per slab
+  uint off;                   // offset of object 0 in a slab
+  void (*ctor)(void*);
+  struct spinlock lock;       // protects partial and the slabs
+  struct slab *partial;       // slabs with at least one free object
+  struct {
+    int n;
+    void *obj[KMAG];
+  } mag[NCPU];                // only touched by its hart, interrupts off
+};
+
+struct kmem_cache kcaches[NCACHE];
+int nkcaches;
+
+// Create a cache of objects of the given size. ctor, if
+// not 0, is run once on each object when its slab is
+// allocated, not on every kmem_cache_alloc().
+// Only called during boot, on hart 0.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size, void (*ctor)(void*))
+{
+  struct kmem_cache *c;
+  uint n;
+
+  if(nkcaches >= NCACHE)
+    panic("kmem_cache_create: too many caches");
+  c = &kcaches[nkcaches++];
+
+  c->name = name;
+  c->size = (size + 7) & ~7;
+  c->ctor = ctor;
+  initlock(&c->lock, name);
+
+  // as many objects as fit after the header and free[].
+  for(n = (PGSIZE - sizeof(struct slab)) / c->size; n > 0; n--){
+    c->off = (sizeof(struct slab) + n * sizeof(ushort) + 7) & ~7;
+    if(c->off + n * c->size <= PGSIZE)
+      break;
+  }
+  if(n == 0)
+    panic("kmem_cache_create: object too large");
+  c->nobj = n;
+  return c;
+}
+
+static void *
+slab_obj(struct kmem_cache *c, struct slab *s, int i)
+{
+  return (char*)s + c->off + i * c->size;
+}
+
+// Allocate and construct a new slab.
+// Called without c->lock.
+static struct slab *
+slab_grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  int i;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->next = 0;
+  s->cache = c;
+  s->inuse = 0;
+  s->nfree = c->nobj;
+  for(i = 0; i < c->nobj; i++){
+    s->free[i] = c->nobj - 1 - i;
+    if(c->ctor)
+      c->ctor(slab_obj(c, s, i));
+  }
+  return s;
+}
+
+// Take one object from the partial slabs.
+// Caller must hold c->lock and know partial is not empty.
+static void *
+slab_get(struct kmem_cache *c)
+{
+  struct slab *s = c->partial;
+
+  s->inuse++;
+  if(--s->nfree == 0)
+    c->partial = s->next;
+  return slab_obj(c, s, s->free[s->nfree]);
+}
+
+// Give object o back to its slab, and free the slab's
+// page if it is now empty and not the only partial slab.
+// Caller must hold c->lock.
+static void
+slab_put(struct kmem_cache *c, void *o)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)o);
+  struct slab **pp;
+
+  if(s->cache != c || ((char*)o - (char*)s - c->off) % c->size != 0)
+    panic("kmem_cache_free");
+
+  s->inuse--;
+  s->free[s->nfree++] = ((char*)o - (char*)s - c->off) / c->size;
+  if(s->nfree == 1){
+    s->next = c->partial;
+    c->partial = s;
+  }
+
+  if(s->inuse == 0 && (c->partial != s || s->next != 0)){
+    for(pp = &c->partial; *pp != s; pp = &(*pp)->next)
+      ;
+    *pp = s->next;
+    kfree((void*)s);
+  }
+}
+
+// Allocate an object from cache c.
+// Returns 0 if no memory is available.
+void *
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct slab *s;
+  void *o;
+  int id, n;
+
+  push_off();
+  id = cpuid();
+  if(c->mag[id].n > 0){
+    o = c->mag[id].obj[--c->mag[id].n];
+    pop_off();
+    return o;
+  }
+  pop_off();
+
+  acquire(&c->lock);
+  if(c->partial == 0){
+    release(&c->lock);
+    if((s = slab_grow(c)) == 0)
+      return 0;
+    acquire(&c->lock);
+    s->next = c->partial;
+    c->partial = s;
+  }
+  o = slab_get(c);
+
+  // refill half of this hart's magazine while we hold the lock.
+  // acquire() disabled interrupts, so cpuid() is stable here.
+  id = cpuid();
+  for(n = c->mag[id].n; n < KMAG/2 && c->partial; n++)
+    c->mag[id].obj[n] = slab_get(c);
+  c->mag[id].n = n;
+  release(&c->lock);
+  return o;
+}
+
+// Return object o to cache c. The object must be in the
+// state the cache's constructor leaves it in.
+void
+kmem_cache_free(struct kmem_cache *c, void *o)
+{
+  int id;
+
+  push_off();
+  id = cpuid();
+  if(c->mag[id].n < KMAG){
+    c->mag[id].obj[c->mag[id].n++] = o;
+    pop_off();
+    return;
+  }
+  pop_off();
+
+  // magazine full: send o and half of the magazine
+  // back to their slabs.
+  acquire(&c->lock);
+  id = cpuid();
+  slab_put(c, o);
+  while(c->mag[id].n > KMAG/2)
+    slab_put(c, c->mag[id].obj[--c->mag[id].n]);
+  release(&c->lock);
+}
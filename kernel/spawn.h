@@ -0,0 +1,17 @@
+// File descriptor actions for spawn(), applied in order to
+// the child's copy of the parent's open files before the
+// child starts. The list ends with an action of type 0.
+
+#define SPAWN_CLOSE  1   // close fd
+#define SPAWN_DUP2   2   // make fd refer to the same file as srcfd
+#define SPAWN_OPEN   3   // open path with omode as fd
+
+#define SPAWN_MAXACT 8   // actions per spawn()
+
+struct spawnact {
+  int type;
+  int fd;
+  int srcfd;     // SPAWN_DUP2
+  int omode;     // SPAWN_OPEN, O_* flags from fcntl.h
+  char *path;    // SPAWN_OPEN
+};
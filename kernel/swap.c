@@ -0,0 +1,170 @@
+// Swap space for anonymous memory.
+//
+// mkfs reserves sb.nswap blocks after the file system, starting
+// at sb.swapstart, which are divided into page-sized slots.
+// The PTE of a swapped-out page has PTE_V clear and PTE_SWAP set,
+// holds the slot number where the PPN would be, and keeps the
+// page's permission bits for swap-in to restore.
+//
+// Each slot has a reference count, because fork copies swap
+// entries (see _uvmcopy()) and uvmunmap() frees them. A slot is
+// busy from swapalloc() until the write to it has finished; a
+// fault on a busy slot waits. Writes are issued in clusters of
+// up to SWAPCLUSTER pages to consecutive slots, and swap-in
+// reads neighbouring pages that were written with the same
+// cluster in the same request.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "defs.h"
+
+#define SLOTBLOCKS (PGSIZE / BSIZE)
+#define NSLOT      (SWAPSIZE / SLOTBLOCKS)
+
+struct {
+  struct spinlock lock;
+  uint start;         // first swap block
+  int nslot;          // slots in the swap area
+  int hint;           // where swapalloc() starts looking
+  uchar ref[NSLOT];   // page tables referring to each slot
+  uchar busy[NSLOT];  // write in progress
+} swap;
+
+// Called by fsinit() once the superblock has been read.
+void swapinit(struct superblock *sb)
+{
+  initlock(&swap.lock, "swap");
+  swap.start = sb->swapstart;
+  swap.nslot = sb->nswap / SLOTBLOCKS;
+  if (swap.nslot > NSLOT)
+    swap.nslot = NSLOT;
+}
+
+// Reserve n consecutive free slots, each with one reference
+// and marked busy until swapdone(). Returns the first slot,
+// or -1 if there is no such run.
+int swapalloc(int n)
+{
+  int s, i, j;
+
+  acquire(&swap.lock);
+  for (i = 0; i < swap.nslot; i++)
+  {
+    s = (swap.hint + i) % swap.nslot;
+    if (s + n > swap.nslot)
+      continue;
+    for (j = 0; j < n; j++)
+      if (swap.ref[s + j] || swap.busy[s + j])
+        break;
+    if (j < n)
+      continue;
+    for (j = 0; j < n; j++)
+    {
+      swap.ref[s + j] = 1;
+      swap.busy[s + j] = 1;
+    }
+    swap.hint = (s + n) % swap.nslot;
+    release(&swap.lock);
+    return s;
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+void swapdup(int slot)
+{
+  acquire(&swap.lock);
+  if (slot >= swap.nslot || swap.ref[slot] == 0)
+    panic("swapdup");
+  swap.ref[slot]++;
+  release(&swap.lock);
+}
+
+// Drop a reference to slot. The slot can be reused once it
+// has no references and is not busy.
+void swapfree(int slot)
+{
+  acquire(&swap.lock);
+  if (slot >= swap.nslot || swap.ref[slot] == 0)
+    panic("swapfree");
+  swap.ref[slot]--;
+  release(&swap.lock);
+}
+
+// Mark n slots from slot as no longer busy.
+void swapdone(int slot, int n)
+{
+  acquire(&swap.lock);
+  for (int i = 0; i < n; i++)
+    swap.busy[slot + i] = 0;
+  wakeup(&swap.busy);
+  release(&swap.lock);
+}
+
+// Write n pages to the n slots from slot with one disk
+// request, then mark the slots as not busy.
+void swapwrite(int slot, char **pages, int n)
+{
+  virtio_disk_rwpages(swap.start + slot * SLOTBLOCKS, pages, n, 1);
+  swapdone(slot, n);
+}
+
+// If va's PTE is a swap entry, read the page back in, along
+// with the following pages that went out in the same cluster.
+// Called in the page-fault path of the process that owns
+// pagetable. Returns 0 if va is not swapped out, 1 if it
+// was swapped in, -1 if out of memory.
+int swapin(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte[SWAPCLUSTER];
+  char *pages[SWAPCLUSTER];
+  uint64 t0 = r_time();
+  int slot, n;
+
+  va = PGROUNDDOWN(va);
+  if (va >= MAXVA || (pte[0] = walk(pagetable, va, 0)) == 0)
+    return 0;
+  if ((*pte[0] & (PTE_V | PTE_SWAP)) != PTE_SWAP)
+    return 0;
+  slot = PTE2SLOT(*pte[0]);
+
+  acquire(&swap.lock);
+  while (swap.busy[slot])
+    sleep(&swap.busy, &swap.lock);
+  release(&swap.lock);
+
+  if ((pages[0] = kalloc()) == 0 &&
+      (reclaim(NRECLAIM) == 0 || (pages[0] = kalloc()) == 0))
+    return -1;
+
+  // read around: the next pages of the cluster, if they are
+  // still swapped out and their writes are done.
+  for (n = 1; n < SWAPCLUSTER && slot + n < swap.nslot && va + n * PGSIZE < MAXVA; n++)
+  {
+    if ((pte[n] = walk(pagetable, va + n * PGSIZE, 0)) == 0)
+      break;
+    if ((*pte[n] & (PTE_V | PTE_SWAP)) != PTE_SWAP || PTE2SLOT(*pte[n]) != slot + n)
+      break;
+    if (*(volatile uchar *)&swap.busy[slot + n])
+      break;
+    if ((pages[n] = kalloc()) == 0)
+      break;
+  }
+
+  virtio_disk_rwpages(swap.start + slot * SLOTBLOCKS, pages, n, 0);
+
+  for (int i = 0; i < n; i++)
+  {
+    // the page no longer matches any file: mark it dirty so
+    // that reclaim swaps it out again rather than dropping it.
+    *pte[i] = PA2PTE(pages[i]) | (PTE_FLAGS(*pte[i]) & ~PTE_SWAP) | PTE_V | PTE_A | PTE_D;
+    swapfree(slot + i);
+  }
+  faultcount(myproc(), FAULT_ANON, 1, t0);
+  return 1;
+}
@@ -106,6 +106,14 @@ extern uint64 sys_getpinfo(void);
 extern uint64 sys_mmap(void);
 extern uint64 sys_munmap(void);
 extern uint64 sys_getpagefaults(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_mprotect(void);
+extern uint64 sys_msync(void);
+extern uint64 sys_madvise(void);
+extern uint64 sys_shmget(void);
+extern uint64 sys_shmat(void);
+extern uint64 sys_shmdt(void);
+extern uint64 sys_faultstat(void);
 
 
 // An array mapping syscall numbers from syscall.h
@@ -137,6 +145,14 @@ static uint64 (*syscalls[])(void) = {
 [SYS_mmap]  sys_mmap,
 [SYS_munmap]  sys_munmap,
 [SYS_getpagefaults] sys_getpagefaults,
+[SYS_spawn]   sys_spawn,
+[SYS_mprotect] sys_mprotect,
+[SYS_msync]   sys_msync,
+[SYS_madvise] sys_madvise,
+[SYS_shmget]  sys_shmget,
+[SYS_shmat]   sys_shmat,
+[SYS_shmdt]   sys_shmdt,
+[SYS_faultstat] sys_faultstat,
 };
 
 void
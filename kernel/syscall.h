@@ -25,3 +25,11 @@
 #define SYS_mmap    24
 #define SYS_munmap  25
 #define SYS_getpagefaults 26
+#define SYS_spawn   27
+#define SYS_mprotect 28
+#define SYS_msync   29
+#define SYS_madvise 30
+#define SYS_shmget  31
+#define SYS_shmat   32
+#define SYS_shmdt   33
+#define SYS_faultstat 34
@@ -15,6 +15,7 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "spawn.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -301,18 +302,13 @@ create(char *path, short type, short major, short minor)
   return 0;
 }
 
-uint64
-sys_open(void)
+// Open path as a new struct file, for open() and spawn().
+// Returns 0 on failure.
+static struct file*
+fileopen(char *path, int omode)
 {
-  char path[MAXPATH];
-  int fd, omode;
   struct file *f;
   struct inode *ip;
-  int n;
-
-  argint(1, &omode);
-  if((n = argstr(0, path, MAXPATH)) < 0)
-    return -1;
 
   begin_op();
 
@@ -320,33 +316,31 @@ sys_open(void)
     ip = create(path, T_FILE, 0, 0);
     if(ip == 0){
       end_op();
-      return -1;
+      return 0;
     }
   } else {
     if((ip = namei(path)) == 0){
       end_op();
-      return -1;
+      return 0;
     }
     ilock(ip);
     if(ip->type == T_DIR && omode != O_RDONLY){
       iunlockput(ip);
       end_op();
-      return -1;
+      return 0;
     }
   }
 
   if(ip->type == T_DEVICE && (ip->major < 0 || ip->major >= NDEV)){
     iunlockput(ip);
     end_op();
-    return -1;
+    return 0;
   }
 
-  if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
-    if(f)
-      fileclose(f);
+  if((f = filealloc()) == 0){
     iunlockput(ip);
     end_op();
-    return -1;
+    return 0;
   }
 
   if(ip->type == T_DEVICE){
@@ -367,6 +361,26 @@ sys_open(void)
   iunlock(ip);
   end_op();
 
+  return f;
+}
+
+uint64
+sys_open(void)
+{
+  char path[MAXPATH];
+  int fd, omode;
+  struct file *f;
+
+  argint(1, &omode);
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
+
+  if((f = fileopen(path, omode)) == 0)
+    return -1;
+  if((fd = fdalloc(f)) < 0){
+    fileclose(f);
+    return -1;
+  }
   return fd;
 }
 
@@ -474,6 +488,105 @@ sys_exec(void)
   return -1;
 }
 
+// Apply the user's spawn actions at uacts to ofile, a copy
+// of this process's file table for the child.
+static int
+spawnacts(uint64 uacts, struct file **ofile)
+{
+  struct spawnact act;
+  char path[MAXPATH];
+  struct file *f;
+  int i;
+
+  for(i = 0; uacts != 0; i++){
+    if(i >= SPAWN_MAXACT)
+      return -1;
+    if(copyin(myproc()->pagetable, (char*)&act, uacts + i*sizeof(act), sizeof(act)) < 0)
+      return -1;
+    if(act.type == 0)
+      break;
+    if(act.fd < 0 || act.fd >= NOFILE)
+      return -1;
+
+    switch(act.type){
+    case SPAWN_CLOSE:
+      f = 0;
+      break;
+    case SPAWN_DUP2:
+      if(act.srcfd < 0 || act.srcfd >= NOFILE || (f = ofile[act.srcfd]) == 0)
+        return -1;
+      filedup(f);
+      break;
+    case SPAWN_OPEN:
+      if(fetchstr((uint64)act.path, path, MAXPATH) < 0)
+        return -1;
+      if((f = fileopen(path, act.omode)) == 0)
+        return -1;
+      break;
+    default:
+      return -1;
+    }
+    if(ofile[act.fd])
+      fileclose(ofile[act.fd]);
+    ofile[act.fd] = f;
+  }
+  return 0;
+}
+
+// spawn(path, argv, acts): start path in a new child process
+// without copying this one, and return the child's pid.
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  struct file *ofile[NOFILE];
+  struct proc *p = myproc();
+  int i, ret = -1;
+  uint64 uargv, uarg, uacts;
+
+  argaddr(1, &uargv);
+  argaddr(2, &uacts);
+  if(argstr(0, path, MAXPATH) < 0) {
+    return -1;
+  }
+  memset(argv, 0, sizeof(argv));
+  for(i=0;; i++){
+    if(i >= NELEM(argv)){
+      goto bad;
+    }
+    if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
+      goto bad;
+    }
+    if(uarg == 0){
+      argv[i] = 0;
+      break;
+    }
+    argv[i] = kalloc();
+    if(argv[i] == 0)
+      goto bad;
+    if(fetchstr(uarg, argv[i], PGSIZE) < 0)
+      goto bad;
+  }
+
+  // the child's file table: ours, edited by the actions.
+  for(i = 0; i < NOFILE; i++)
+    if((ofile[i] = p->ofile[i]) != 0)
+      filedup(ofile[i]);
+  if(spawnacts(uacts, ofile) < 0){
+    for(i = 0; i < NOFILE; i++)
+      if(ofile[i])
+        fileclose(ofile[i]);
+    goto bad;
+  }
+
+  ret = spawn(path, argv, ofile);
+
+ bad:
+  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
+    kfree(argv[i]);
+  return ret;
+}
+
 uint64
 sys_pipe(void)
 {
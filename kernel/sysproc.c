@@ -109,7 +109,11 @@ sys_settickets(void)
   if (tickets < 1)
     return -1;
 
-  myproc()->tickets = tickets;
+  struct proc *p = myproc();
+  acquire(&p->lock);
+  p->tickets = tickets;
+  runqset(p);
+  release(&p->lock);
   return 0; // worked
 }
 
@@ -129,24 +133,38 @@ void *
 sys_mmap(void)
 {
   
-  int length, prot, flags, fd, offset;
+  int length, prot, flags, fd, offset, fixed;
   uint64 addr;
   
   struct file * f;
 
 
-  // addr y offset podemos asumir q son 0.
+  // addr es una sugerencia salvo con MAP_FIXED.
 
   argaddr(0, &addr);
   argint(1, &length);
   argint(2, &prot);
   argint(3, &flags);
   argint(5, &offset);
-  
-  if(argfd(4, &fd, &f) < 0)
+
+  if(flags & ~(MAP_TYPE | MAP_ANONYMOUS | MAP_FIXED))
   {
     return (void *) MAP_FAILED;
   }
+  fixed = (flags & MAP_FIXED) != 0;
+
+  // anonymous memory is not backed by any file.
+  if(flags & MAP_ANONYMOUS)
+  {
+    f = 0;
+    fd = -1;
+    offset = 0;
+  }
+  else if(argfd(4, &fd, &f) < 0)
+  {
+    return (void *) MAP_FAILED;
+  }
+  flags &= MAP_TYPE;
     
   if(prot != PROT_READ && prot != PROT_WRITE && prot != PROT_RW)
   {
@@ -163,12 +181,12 @@ sys_mmap(void)
     return (void *) MAP_FAILED;
   }
 
-  if(f->readable == 0)
+  if(f && f->readable == 0)
   {
     return (void *) MAP_FAILED;
   }
 
-  if((flags == MAP_SHARED) && (prot == PROT_WRITE || prot == PROT_RW) && f->writable == 0)
+  if(f && (flags == MAP_SHARED) && (prot == PROT_WRITE || prot == PROT_RW) && f->writable == 0)
   {
     return (void *) MAP_FAILED;
   }
@@ -178,7 +196,13 @@ sys_mmap(void)
     return (void *) MAP_FAILED;
   }
 
-  addr = allocvma(length, prot, flags, f, fd, offset);
+  // the offset must be page aligned.
+  if(offset < 0 || offset % PGSIZE != 0)
+  {
+    return (void *) MAP_FAILED;
+  }
+
+  addr = allocvma(addr, length, prot, flags, f, fd, offset, fixed, 0);
   return (void *) addr;
 
 }
@@ -206,6 +230,125 @@ sys_munmap(void)
   return deallocvma(addr, size);
 }
 
+int
+sys_mprotect(void)
+{
+  uint64 addr;
+  int len, prot;
+
+  argaddr(0, &addr);
+  argint(1, &len);
+  argint(2, &prot);
+
+  if(addr % PGSIZE != 0 || len < 0)
+    return -1;
+
+  // as for mmap, no PROT_NONE or PROT_EXEC.
+  if(prot != PROT_READ && prot != PROT_WRITE && prot != PROT_RW)
+    return -1;
+
+  if(len == 0)
+    return 0;
+
+  return mprotectvma(addr, len, prot);
+}
+
+int
+sys_madvise(void)
+{
+  uint64 addr;
+  int len, advice;
+
+  argaddr(0, &addr);
+  argint(1, &len);
+  argint(2, &advice);
+
+  if(addr % PGSIZE != 0 || len < 0)
+    return -1;
+
+  if(advice < MADV_NORMAL || advice > MADV_DONTNEED)
+    return -1;
+
+  if(len == 0)
+    return 0;
+
+  return madvisevma(addr, len, advice);
+}
+
+int
+sys_msync(void)
+{
+  uint64 addr;
+  int len, flags;
+
+  argaddr(0, &addr);
+  argint(1, &len);
+  argint(2, &flags);
+
+  if(addr % PGSIZE != 0 || len < 0)
+    return -1;
+
+  // exactly one of MS_ASYNC and MS_SYNC.
+  if(flags != MS_ASYNC && flags != MS_SYNC)
+    return -1;
+
+  if(len == 0)
+    return 0;
+
+  return msyncvma(addr, len, flags);
+}
+
+uint64
+sys_shmget(void)
+{
+  int key, size, flags;
+
+  argint(0, &key);
+  argint(1, &size);
+  argint(2, &flags);
+
+  if(size < 0 || (flags & ~(IPC_CREAT | IPC_EXCL)))
+    return -1;
+
+  return shmget(key, size, flags);
+}
+
+uint64
+sys_shmat(void)
+{
+  int id, flags;
+  uint64 addr;
+
+  argint(0, &id);
+  argaddr(1, &addr);
+  argint(2, &flags);
+
+  if(flags & ~SHM_RDONLY)
+    return (uint64) MAP_FAILED;
+
+  return shmat(id, addr, flags);
+}
+
+uint64
+sys_shmdt(void)
+{
+  uint64 addr;
+
+  argaddr(0, &addr);
+  return shmdt(addr);
+}
+
+uint64
+sys_faultstat(void)
+{
+  int pid;
+  uint64 fs;
+
+  argint(0, &pid);
+  argaddr(1, &fs);
+  return faultinfo(pid, fs);
+}
+
 int
 sys_getpagefaults(void)
 {
@@ -20,6 +20,27 @@ void kernelvec();
 
 extern int devintr();
 
+#ifdef SUMCOPY
+// (faulting instruction, fixup) pairs from usercopy.S;
+// kernel.ld collects them between ex_table and ex_table_end.
+struct exentry {
+  uint64 insn;
+  uint64 fixup;
+};
+extern struct exentry ex_table[], ex_table_end[];
+
+// Where to resume after a page fault at pc, or 0 if
+// pc is not one of the user copy loads and stores.
+static uint64
+exfixup(uint64 pc)
+{
+  for (struct exentry *e = ex_table; e < ex_table_end; e++)
+    if (e->insn == pc)
+      return e->fixup;
+  return 0;
+}
+#endif
+
 void trapinit(void)
 {
   initlock(&tickslock, "time");
@@ -31,47 +52,283 @@ void trapinithart(void)
   w_stvec((uint64)kernelvec);
 }
 
-void allocPhysicalVMA(struct vma *vma, struct proc *p, uint64 addr, int prot)
+// How many pages to map for a fault at va. The VMA's
+// fault-around window doubles, up to FAULTAROUND, when the
+// fault follows on from the last window (sequential access)
+// and halves otherwise. madvise() can fix it at one page
+// (MADV_RANDOM) or at FAULTAROUND (MADV_SEQUENTIAL).
+static int
+faultwindow(struct vma *vma, uint64 va)
 {
-  // leo y cargo la pagina
+  if (vma->advice == MADV_RANDOM)
+    return 1;
+  if (vma->advice == MADV_SEQUENTIAL)
+    return FAULTAROUND;
+  if (va >= vma->fanext && va < vma->fanext + vma->fawin * PGSIZE)
+  {
+    if (vma->fawin < FAULTAROUND)
+      vma->fawin *= 2;
+  }
+  else if (vma->fawin > 1)
+  {
+    vma->fawin /= 2;
+  }
+  return vma->fawin;
+}
 
-  // coger un MP fisico
-  char *phy_addr = kalloc();
-  if (phy_addr == 0)
+// Drop-behind for MADV_SEQUENTIAL, after a fault at va: unmap
+// the clean pages of the window before the last one, which a
+// sequential reader is done with. Dirty pages stay, for
+// munmap() to write back or because they are private copies.
+static void
+dropbehind(struct vma *vma, struct proc *p, uint64 va)
+{
+  uint64 start, end;
+  pte_t *pte;
+
+  if (va - vma->addr < FAULTAROUND * PGSIZE)
+    return;
+  end = va - FAULTAROUND * PGSIZE;
+  start = end - vma->addr < FAULTAROUND * PGSIZE ? vma->addr : end - FAULTAROUND * PGSIZE;
+  for (uint64 a = start; a < end; a += PGSIZE)
   {
-    printf("allocPhysicalVMA(): No physical pages available. pid=%d\n", p->pid);
+    pte = walk(p->pagetable, a, 0);
+    if (pte == 0 || (*pte & (PTE_V | PTE_D)) != PTE_V)
+      continue;
+    kput((void *)PTE2PA(*pte));
+    *pte = 0;
+    uvmflushva(a);
+  }
+}
+
+// Map the page at addr of an anonymous VMA: a fresh zero
+// page, or for a shared VMA the page of its anon object.
+static void
+allocAnonVMA(struct vma *vma, struct proc *p, uint64 addr, int prot)
+{
+  uint64 va = PGROUNDDOWN(addr);
+  uint64 t0 = r_time();
+  char *pa;
+
+  reclaim_check();
+
+  if (vma->anon)
+    pa = anonpage(vma->anon, (va - vma->addr + vma->offset) / PGSIZE);
+  else if ((pa = kalloc_zeroed()) == 0 && reclaim(NRECLAIM) > 0)
+    pa = kalloc_zeroed();
+  if (pa == 0)
+  {
+    printf("allocAnonVMA(): No physical pages available. pid=%d\n", p->pid);
+    setkilled(p);
+    return;
+  }
+  p->page_faults++;
+
+  if (mappages(p->pagetable, va, PGSIZE, (uint64)pa, prot) < 0)
+  {
+    printf("allocAnonVMA(): Could not map physical to virtual address, pid=%d\n", p->pid);
+    setkilled(p);
+    kput(pa);
+    return;
+  }
+  faultcount(p, FAULT_ANON, 0, t0);
+}
+
+// Map zeroed memory at addr, in the part of p's heap that
+// sbrk() has grown over and nothing has touched yet.
+// Returns 1 if addr is already mapped or swapped out, which
+// below p->sz only the stack guard page can be.
+int
+allocHeap(struct proc *p, uint64 addr)
+{
+  uint64 lo = PGROUNDUP(p->text.addr + p->text.size);
+  uint64 t0 = r_time();
+  int r;
+
+  if (p->data.used && lo < PGROUNDUP(p->data.addr + p->data.size))
+    lo = PGROUNDUP(p->data.addr + p->data.size);
+
+  reclaim_check();
+
+  if ((r = uvmzero(p->pagetable, addr, lo, p->sz)) < 0 &&
+      reclaim(NRECLAIM) > 0)
+    r = uvmzero(p->pagetable, addr, lo, p->sz);
+  if (r < 0)
+  {
+    printf("allocHeap(): No physical pages available. pid=%d\n", p->pid);
     setkilled(p);
+    return 0;
+  }
+  if (r == 0)
+  {
+    p->page_faults++;
+    faultcount(p, FAULT_ANON, 0, t0);
+  }
+  return r;
+}
+
+// Map the page at addr of a file-backed VMA and, to save
+// later faults, up to fawin - 1 of the following pages that
+// are not mapped yet and hold file contents. Pages whose
+// blocks are consecutive on disk are read with one request.
+// Text and private mmap pages come from the page cache, read-
+// only, unless write says the faulting access is a store.
+// Anonymous VMAs are handled by allocAnonVMA().
+void allocPhysicalVMA(struct vma *vma, struct proc *p, uint64 addr, int prot, int write)
+{
+  char *pages[FAULTAROUND];
+  char shared[FAULTAROUND];
+  uint64 va = PGROUNDDOWN(addr);
+  uint64 fileend = vma->addr + vma->filesize;
+  uint64 vmaend = PGROUNDUP(vma->addr + vma->size);
+  int win = faultwindow(vma, va);
+  int cache = (vma == &p->text || (vma != &p->data && vma->flags == MAP_PRIVATE)) && (prot & PTE_R);
+  int type = vma == &p->text ? FAULT_TEXT : vma == &p->data ? FAULT_DATA : FAULT_MMAP;
+  uint64 t0 = r_time();
+  int n, r, major, retried = 0;
+  pte_t *pte;
+
+  if (vma->ip == 0)
+  {
+    allocAnonVMA(vma, p, addr, prot);
+    return;
   }
 
-  // para que no vea cosas de procesos anteriores.
-  memset(phy_addr, 0, PGSIZE);
+  // si queda poca memoria, expulsar paginas limpias de ficheros.
+  // reclaim() no se llama nunca con ilock cogido: recorre las VMAs
+  // de otros procesos y escribe en el swap.
+  reclaim_check();
+
+again:
+  // paginas vecinas: solo las que no estan mapeadas ni en swap.
+  for (n = 1; n < win && va + n * PGSIZE < vmaend && va + n * PGSIZE < fileend; n++)
+  {
+    pte = walk(p->pagetable, va + n * PGSIZE, 0);
+    if (pte && (*pte & (PTE_V | PTE_SWAP)))
+      break;
+  }
 
   ilock(vma->ip);
-  int size = PGSIZE;
 
-  if (PGROUNDDOWN(vma->addr + vma->filesize) >= PGROUNDDOWN(addr))
+  // coger los MP fisicos: de la cache de paginas si ya estan, si no
+  // nuevos. si la pagina entera viene del fichero no hace falta
+  // ponerla a cero antes: readi la sobreescribe completa.
+  for (int i = 0; i < n; i++)
   {
-    if (PGROUNDDOWN(vma->addr + vma->filesize) == PGROUNDDOWN(addr))
+    uint64 a = va + i * PGSIZE;
+    int whole = a < PGROUNDDOWN(fileend);
+    shared[i] = 0;
+    if (cache && whole && !(write && i == 0) &&
+        (pages[i] = pcache_get(vma->ip->dev, vma->ip->inum, PGROUNDDOWN(a - vma->addr) + vma->offset)) != 0)
     {
-      size = vma->filesize - PGROUNDDOWN(addr - vma->addr);
+      shared[i] = 1;
+      continue;
     }
-  
-    if (readi(vma->ip, 0, (uint64)phy_addr, PGROUNDDOWN(addr - vma->addr) + vma->offset, size) < 0)
+    pages[i] = whole ? kalloc() : kalloc_zeroed();
+    if (pages[i] == 0)
+    {
+      // las vecinas son opcionales.
+      n = i;
+      break;
+    }
+  }
+  if (n == 0)
+  {
+    iunlock(vma->ip);
+    // sin memoria ni para la pagina que fallo: liberar algo y reintentar.
+    if (!retried && reclaim(NRECLAIM) > 0)
+    {
+      retried = 1;
+      goto again;
+    }
+    printf("allocPhysicalVMA(): No physical pages available. pid=%d\n", p->pid);
+    setkilled(p);
+    return;
+  }
+
+  // leo y cargo las paginas que no estaban en la cache
+  for (int i = 0; i < n; i += r)
+  {
+    uint64 a = va + i * PGSIZE;
+    uint off = PGROUNDDOWN(a - vma->addr) + vma->offset;
+    int size;
+
+    r = 1;
+    if (shared[i])
+    {
+      continue;
+    }
+    else if (a < PGROUNDDOWN(fileend))
+    {
+      // paginas enteras del fichero: intentar una sola peticion al disco.
+      int m = 1;
+      while (i + m < n && !shared[i + m] && a + m * PGSIZE < PGROUNDDOWN(fileend))
+        m++;
+      if ((r = readi_pages(vma->ip, off, &pages[i], m)) > 0)
+        continue;
+      r = 1;
+      size = PGSIZE;
+    }
+    else if (a == PGROUNDDOWN(fileend))
+    {
+      size = fileend - a;
+    }
+    else
+    {
+      continue;
+    }
+
+    int got = readi(vma->ip, 0, (uint64)pages[i], off, size);
+    if (got < 0)
     {
       printf("allocPhysicalVMA(): failed. pid=%d\n", p->pid);
       setkilled(p);
+      cache = 0;
+      got = 0;
     }
+    // para que no vea cosas de procesos anteriores si el fichero es mas corto.
+    if (size == PGSIZE && got < PGSIZE)
+      memset(pages[i] + got, 0, PGSIZE - got);
+  }
+
+  // fallo mayor si la pagina que fallo hubo que leerla del fichero.
+  major = !shared[0] && va < fileend;
+
+  // ofrecer las paginas leidas a la cache para otros procesos.
+  for (int i = 0; i < n && cache; i++)
+  {
+    uint64 a = va + i * PGSIZE;
+    if (!shared[i] && a < PGROUNDDOWN(fileend) && !(write && i == 0))
+      shared[i] = pcache_add(vma->ip->dev, vma->ip->inum, PGROUNDDOWN(a - vma->addr) + vma->offset, pages[i]);
   }
   p->page_faults++;
   iunlock(vma->ip);
 
-
-  if (mappages(p->pagetable, PGROUNDDOWN(addr), PGSIZE, (uint64)phy_addr, prot) < 0)
+  for (int i = 0; i < n; i++)
   {
-    kfree(phy_addr);
-    printf("allocPhysicalVMA(): Could not map physical to virtual address, pid=%d\n", p->pid);
-    setkilled(p);
+    // una pagina compartida con la cache solo se mapea de lectura;
+    // si la VMA se puede escribir, la escritura hace copy-on-write.
+    int perm = prot;
+    if (shared[i] && (prot & PTE_W))
+      perm = (prot & ~PTE_W) | PTE_COW;
+    if (mappages(p->pagetable, va + i * PGSIZE, PGSIZE, (uint64)pages[i], perm) < 0)
+    {
+      if (i == 0)
+      {
+        printf("allocPhysicalVMA(): Could not map physical to virtual address, pid=%d\n", p->pid);
+        setkilled(p);
+      }
+      for (int k = i; k < n; k++)
+        kput(pages[k]);
+      n = i;
+      break;
+    }
   }
+  if (n > 0)
+    faultcount(p, type, major, t0);
+  vma->fanext = va + n * PGSIZE;
+  if (vma->advice == MADV_SEQUENTIAL)
+    dropbehind(vma, p, va);
 }
 
 //
@@ -114,10 +371,13 @@ void usertrap(void)
   else if (r_scause() == 12)
   {
     uint64 addr = r_stval();
-    if (addr >= p->text.addr && addr < (p->text.addr + p->text.size))
+    // si fault-around ya la mapeo, el TLB tenia una entrada vieja:
+    // basta con descartarla y reintentar.
+    if (!uvmstale(p->pagetable, addr, PTE_X) &&
+        addr >= p->text.addr && addr < (p->text.addr + p->text.size))
     {
       int prot = PTE_R | PTE_X;
-      allocPhysicalVMA(&(p->text), p, addr, prot | PTE_U);
+      allocPhysicalVMA(&(p->text), p, addr, prot | PTE_U, 0);
     }
   }
   else if (r_scause() == 13 || r_scause() == 15)
@@ -130,89 +390,59 @@ void usertrap(void)
     int cow = 0;
 
     uint64 phy = walkaddr(p->pagetable, addr);
-    if (phy && r_scause() == 15)
+    int sw = 0;
+    if (uvmstale(p->pagetable, addr, r_scause() == 15 ? PTE_W : PTE_R))
     {
-      for (int i = 0; i < PER_PROCESS_VMAS && !cow; i++)
+      // ya estaba mapeada: el TLB tenía una entrada vieja.
+      solved = 1;
+    }
+    else if ((sw = swapin(p->pagetable, addr)) != 0)
+    {
+      // an anonymous page that was swapped out.
+      if (sw < 0)
       {
-        if (p->vmas[i] == 0)
-          continue;
-
-        if (addr >= p->vmas[i]->addr && addr < (p->vmas[i]->addr + p->vmas[i]->size))
-        {
-          cow = 1;
-        }
+        printf("usertrap(): No physical pages available. pid=%d\n", p->pid);
+        setkilled(p);
       }
-      if (cow)
+      solved = 1;
+    }
+    else if (phy && r_scause() == 15)
+    {
+      // a write to a present page: only allowed if it is copy-on-write.
+      cow = cowfault(p->pagetable, addr);
+      if (cow < 0)
       {
-        int ref = getref((void *)phy);
-        if (ref > 1)
-        {
-          char *new_phy = kalloc();
-          if (new_phy == 0)
-          {
-            printf("usertrap(): No physical pages available. pid=%d\n", p->pid);
-            setkilled(p);
-          }
-          memcpy(new_phy, (void *)phy, PGSIZE);
-          uint64 *pte = walk(p->pagetable, addr, 0);
-          *pte = *pte & ~(PTE_V);
-          if (mappages(p->pagetable, PGROUNDDOWN(addr), PGSIZE, (uint64)new_phy, PTE_FLAGS(*pte) | PTE_W) < 0)
-          {
-            kfree(new_phy);
-            printf("usertrap(): Could not map physical to virtual address, pid=%d\n", p->pid);
-            setkilled(p);
-          }
-          decref((void *)phy);
-        }
-        if (ref == 1)
-        {
-          uint64 *pte = walk(p->pagetable, addr, 0);
-          *pte = *pte | PTE_W;
-        }
-        solved = 1;
+        printf("usertrap(): No physical pages available. pid=%d\n", p->pid);
+        setkilled(p);
       }
+      solved = cow <= 0;
     }
     else if (addr >= p->text.addr && addr < (p->text.addr + p->text.size))
     {
       int prot = PTE_R | PTE_X;
-      allocPhysicalVMA(&(p->text), p, addr, prot | PTE_U);
+      allocPhysicalVMA(&(p->text), p, addr, prot | PTE_U, 0);
       solved = 1;
     }
     else if (addr >= p->data.addr && addr < (p->data.addr + p->data.size))
     {
       int prot = PTE_R | PTE_W;
-      allocPhysicalVMA(&(p->data), p, addr, prot | PTE_U);
+      allocPhysicalVMA(&(p->data), p, addr, prot | PTE_U, r_scause() == 15);
       solved = 1;
     }
     else
     {
-      for (int i = 0; i < PER_PROCESS_VMAS && !solved; i++)
+      struct vma *vma = findvma(p, addr);
+      if (vma)
       {
-        if (p->vmas[i] == 0)
-          continue;
-
-        if (addr >= p->vmas[i]->addr && addr < (p->vmas[i]->addr + p->vmas[i]->size))
-        {
-          int prot;
-          switch (p->vmas[i]->prot)
-          {
-          case (PROT_READ):
-            prot = PTE_R;
-            break;
-          case (PROT_WRITE):
-            prot = PTE_W;
-            break;
-          case (PROT_RW):
-            prot = PTE_R | PTE_W;
-            break;
-          default:
-            prot = 0;
-          }
-
-          allocPhysicalVMA(p->vmas[i], p, addr, prot | PTE_U);
-
-          solved = 1;
-        }
+        int prot = vmaperm(vma);
+        allocPhysicalVMA(vma, p, addr, prot | PTE_U, r_scause() == 15);
+
+        solved = 1;
+      }
+      else if (addr < p->sz)
+      {
+        // heap que sbrk() reservó y nadie tocó todavía.
+        solved = allocHeap(p, addr) == 0;
       }
     }
 
@@ -278,14 +508,19 @@ void usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  // tell trampoline.S the user page table to switch to, tagged
+  // with the process's ASID; without ASIDs it has to flush the
+  // TLB on the way out and on the way back in.
+  int asid = asidget(p);
+  uint64 flush = asid < 0;
+  uint64 satp = MAKE_SATP(p->pagetable, flush ? 0 : asid);
+  p->trapframe->kernel_flush = flush;
 
   // jump to userret in trampoline.S at the top of memory, which
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
   uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64))trampoline_userret)(satp);
+  ((void (*)(uint64, uint64))trampoline_userret)(satp, flush);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -303,13 +538,35 @@ void kerneltrap()
   if (intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
+#ifdef SUMCOPY
+  uint64 fixup;
+  if ((scause == 13 || scause == 15) && (fixup = exfixup(sepc)) != 0)
+  {
+    // fallo en usercopy.S: que la copia devuelva -1 y
+    // la rehaga recorriendo la tabla de páginas.
+    w_sepc(fixup);
+    w_sstatus(sstatus);
+    return;
+  }
+#endif
+
+  // una pagina de usuario que ya esta mapeada y el TLB tenia una
+  // entrada vieja (ver uvmstale()): descartarla y reintentar.
+  if (p != 0 && (scause == 12 || scause == 13 || scause == 15) &&
+      uvmstale(p->pagetable, r_stval(), scause == 12 ? PTE_X : scause == 15 ? PTE_W : PTE_R))
+  {
+    w_sepc(sepc);
+    w_sstatus(sstatus);
+    return;
+  }
+
   if (r_scause() == 12)
   {
     uint64 addr = r_stval();
     if (addr >= p->text.addr && addr < (p->text.addr + p->text.size))
     {
       int prot = PTE_R | PTE_X;
-      allocPhysicalVMA(&(p->text), p, addr, prot | PTE_U);
+      allocPhysicalVMA(&(p->text), p, addr, prot | PTE_U, 0);
     }
   }
   else if (r_scause() == 13 || r_scause() == 15)
@@ -322,89 +579,54 @@ void kerneltrap()
     int cow = 0;
 
     uint64 phy = walkaddr(p->pagetable, addr);
-    if (phy && r_scause() == 15)
+    int sw = swapin(p->pagetable, addr);
+    if (sw != 0)
     {
-      for (int i = 0; i < PER_PROCESS_VMAS && !cow; i++)
+      // an anonymous page that was swapped out.
+      if (sw < 0)
       {
-        if (p->vmas[i] == 0)
-          continue;
-
-        if (addr >= p->vmas[i]->addr && addr < (p->vmas[i]->addr + p->vmas[i]->size))
-        {
-          cow = 1;
-        }
+        printf("kerneltrap(): No physical pages available. pid=%d\n", p->pid);
+        setkilled(p);
       }
-      if (cow)
+      solved = 1;
+    }
+    else if (phy && r_scause() == 15)
+    {
+      // a write to a present page: only allowed if it is copy-on-write.
+      cow = cowfault(p->pagetable, addr);
+      if (cow < 0)
       {
-        int ref = getref((void *)phy);
-        if (ref > 1)
-        {
-          char *new_phy = kalloc();
-          if (new_phy == 0)
-          {
-            printf("kerneltrap(): No physical pages available. pid=%d\n", p->pid);
-            setkilled(p);
-          }
-          memcpy(new_phy, (void *)phy, PGSIZE);
-          uint64 *pte = walk(p->pagetable, addr, 0);
-          *pte = *pte & ~(PTE_V);
-          if (mappages(p->pagetable, PGROUNDDOWN(addr), PGSIZE, (uint64)new_phy, PTE_FLAGS(*pte) | PTE_W) < 0)
-          {
-            kfree(new_phy);
-            printf("kerneltrap(): Could not map physical to virtual address, pid=%d\n", p->pid);
-            setkilled(p);
-          }
-          decref((void *)phy);
-        }
-        if (ref == 1)
-        {
-          uint64 *pte = walk(p->pagetable, addr, 0);
-          *pte = *pte | PTE_W;
-        }
-        solved = 1;
+        printf("kerneltrap(): No physical pages available. pid=%d\n", p->pid);
+        setkilled(p);
       }
+      solved = cow <= 0;
     }
     else if (addr >= p->text.addr && addr < (p->text.addr + p->text.size))
     {
       int prot = PTE_R | PTE_X;
-      allocPhysicalVMA(&(p->text), p, addr, prot | PTE_U);
+      allocPhysicalVMA(&(p->text), p, addr, prot | PTE_U, 0);
       solved = 1;
     }
     else if (addr >= p->data.addr && addr < (p->data.addr + p->data.size))
     {
       int prot = PTE_R | PTE_W;
-      allocPhysicalVMA(&(p->data), p, addr, prot | PTE_U);
+      allocPhysicalVMA(&(p->data), p, addr, prot | PTE_U, r_scause() == 15);
       solved = 1;
     }
     else
     {
-      for (int i = 0; i < PER_PROCESS_VMAS && !solved; i++)
+      struct vma *vma = findvma(p, addr);
+      if (vma)
+      {
+        int prot = vmaperm(vma);
+        allocPhysicalVMA(vma, p, addr, prot | PTE_U, r_scause() == 15);
+
+        solved = 1;
+      }
+      else if (addr < p->sz)
       {
-        if (p->vmas[i] == 0)
-          continue;
-
-        if (addr >= p->vmas[i]->addr && addr < (p->vmas[i]->addr + p->vmas[i]->size))
-        {
-          int prot;
-          switch (p->vmas[i]->prot)
-          {
-          case (PROT_READ):
-            prot = PTE_R;
-            break;
-          case (PROT_WRITE):
-            prot = PTE_W;
-            break;
-          case (PROT_RW):
-            prot = PTE_R | PTE_W;
-            break;
-          default:
-            prot = 0;
-          }
-
-          allocPhysicalVMA(p->vmas[i], p, addr, prot | PTE_U);
-
-          solved = 1;
-        }
+        // heap que sbrk() reservó y nadie tocó todavía.
+        solved = allocHeap(p, addr) == 0;
       }
     }
 
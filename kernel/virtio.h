@@ -47,7 +47,8 @@
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+// a request uses two plus one per data buffer.
+#define NUM 16
 
 // a single descriptor, from the spec.
 struct virtq_desc {
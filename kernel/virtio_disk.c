@@ -46,7 +46,7 @@ static struct disk {
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    char done;    // set by virtio_disk_intr()
     char status;
   } info[NUM];
 
@@ -118,14 +118,11 @@ virtio_disk_init(void)
     panic("virtio disk max queue too short");
 
   // allocate and zero queue memory.
-  disk.desc = kalloc();
-  disk.avail = kalloc();
-  disk.used = kalloc();
+  disk.desc = kalloc_zeroed();
+  disk.avail = kalloc_zeroed();
+  disk.used = kalloc_zeroed();
   if(!disk.desc || !disk.avail || !disk.used)
     panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
 
   // set queue size.
   *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
@@ -196,12 +193,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+allocn_desc(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -212,27 +208,32 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// read or write n buffers of len bytes each, which the disk
+// sees as consecutive sectors starting at sector, with a
+// single request. sleeps until the request has finished.
+static void
+virtio_disk_req(uint64 sector, char **data, int n, uint len, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  int idx[NUM];
+
+  if(n < 1 || n + 2 > NUM)
+    panic("virtio_disk_req");
 
   acquire(&disk.vdisk_lock);
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // one descriptor for type/reserved/sector, then the data,
+  // then one for a 1-byte status result. the data may be
+  // split over several descriptors.
 
-  // allocate the three descriptors.
-  int idx[3];
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(allocn_desc(idx, n + 2) == 0) {
       break;
     }
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -249,24 +250,25 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(int i = 1; i <= n; i++){
+    disk.desc[idx[i]].addr = (uint64) data[i-1];
+    disk.desc[idx[i]].len = len;
+    if(write)
+      disk.desc[idx[i]].flags = 0; // device reads the data
+    else
+      disk.desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes the data
+    disk.desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    disk.desc[idx[i]].next = idx[i+1];
+  }
 
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n+1]].next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  // record that the request is in flight, for virtio_disk_intr().
+  disk.info[idx[0]].done = 0;
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
@@ -281,16 +283,34 @@ virtio_disk_rw(struct buf *b, int write)
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
   // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+  while(disk.info[idx[0]].done == 0) {
+    sleep(&disk.info[idx[0]], &disk.vdisk_lock);
   }
 
-  disk.info[idx[0]].b = 0;
   free_chain(idx[0]);
 
   release(&disk.vdisk_lock);
 }
 
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  char *data = (char *) b->data;
+
+  b->disk = 1;
+  virtio_disk_req(b->blockno * (BSIZE / 512), &data, 1, BSIZE, write);
+  b->disk = 0;
+}
+
+// read or write n pages, which need not be physically
+// contiguous, to consecutive disk blocks starting at
+// blockno, with a single request.
+void
+virtio_disk_rwpages(uint blockno, char **pages, int n, int write)
+{
+  virtio_disk_req(blockno * (BSIZE / 512), pages, n, PGSIZE, write);
+}
+
 void
 virtio_disk_intr()
 {
@@ -316,9 +336,8 @@ virtio_disk_intr()
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    disk.info[id].done = 1;   // disk is done with the request
+    wakeup(&disk.info[id]);
 
     disk.used_idx += 1;
   }
@@ -18,14 +18,22 @@ extern char etext[]; // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+static int copyout_walk(pagetable_t, uint64, char *, uint64);
+static int copyin_walk(pagetable_t, char *, uint64, uint64);
+static int copyinstr_walk(pagetable_t, char *, uint64, uint64);
+
+#ifdef SUMCOPY
+// where user address va is mapped in a process's kernel page table.
+#define UALIAS(va) ((va) | 0xffffffc000000000L)
+#endif
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t)kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t)kalloc_zeroed();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -65,15 +73,95 @@ void kvminithart()
   // wait for any previous writes to the page table memory to finish.
   sfence_vma();
 
-  w_satp(MAKE_SATP(kernel_pagetable));
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
 
   // flush stale entries from the TLB.
   sfence_vma();
 }
 
+// Make a process's kernel page table: the kernel's mappings,
+// which all live in the lower half of the address space, and
+// an upper half for kvmuser() to fill in.
+// Returns 0 if out of memory.
+pagetable_t
+kvmcreate(void)
+{
+  pagetable_t kpgtbl;
+
+  if ((kpgtbl = (pagetable_t)kalloc()) == 0)
+    return 0;
+  memmove(kpgtbl, kernel_pagetable, PGSIZE / 2);
+  memset(kpgtbl + 256, 0, PGSIZE / 2);
+  return kpgtbl;
+}
+
+// Point the upper half of a process's kernel page table at the
+// top level of its user page table upt, so that user address
+// va is also mapped at UALIAS(va), through the same lower
+// levels. upt 0 clears the alias, before upt is freed.
+void
+kvmuser(pagetable_t kpgtbl, pagetable_t upt)
+{
+  if (upt)
+    memmove(kpgtbl + 256, upt, PGSIZE / 2);
+  else
+    memset(kpgtbl + 256, 0, PGSIZE / 2);
+  sfence_vma();
+}
+
+// Switch this hart to page table pgtbl, or back to
+// kernel_pagetable if pgtbl is 0.
+void
+kvmswitch(pagetable_t pgtbl)
+{
+  if (pgtbl == 0)
+    pgtbl = kernel_pagetable;
+  sfence_vma();
+  w_satp(MAKE_SATP(pgtbl, 0));
+  sfence_vma();
+}
+
+// Return the address of the level-1 PTE for va, which is
+// either invalid, a megapage leaf, or points to a level-0
+// page table. If alloc!=0, create the level-1 page-table
+// page if needed.
+static pte_t *
+walkl1(pagetable_t pagetable, uint64 va, int alloc)
+{
+  pte_t *pte = &pagetable[PX(2, va)];
+  if (*pte & PTE_V)
+  {
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  }
+  else
+  {
+    if (!alloc || (pagetable = (pde_t *)kalloc_zeroed()) == 0)
+      return 0;
+    *pte = PA2PTE(pagetable) | PTE_V;
+  }
+  return &pagetable[PX(1, va)];
+}
+
+// If va is mapped by a 2MB megapage, return its level-1
+// leaf PTE, otherwise 0.
+pte_t *
+megapte(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+
+  if (va >= MAXVA)
+    return 0;
+  pte = walkl1(pagetable, va, 0);
+  if (pte && (*pte & PTE_V) && PTE_LEAF(*pte))
+    return pte;
+  return 0;
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
+// If va lies in a megapage, this is the level-1 leaf PTE
+// that maps the whole 2MB.
 //
 // The risc-v Sv39 scheme has three levels of page-table
 // pages. A page-table page contains 512 64-bit PTEs.
@@ -86,23 +174,24 @@ void kvminithart()
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
+  pte_t *pte;
+
   if (va >= MAXVA)
     panic("walk");
 
-  for (int level = 2; level > 0; level--)
+  if ((pte = walkl1(pagetable, va, alloc)) == 0)
+    return 0;
+  if (*pte & PTE_V)
   {
-    pte_t *pte = &pagetable[PX(level, va)];
-    if (*pte & PTE_V)
-    {
-      pagetable = (pagetable_t)PTE2PA(*pte);
-    }
-    else
-    {
-      if (!alloc || (pagetable = (pde_t *)kalloc()) == 0)
-        return 0;
-      memset(pagetable, 0, PGSIZE);
-      *pte = PA2PTE(pagetable) | PTE_V;
-    }
+    if (PTE_LEAF(*pte))
+      return pte;
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  }
+  else
+  {
+    if (!alloc || (pagetable = (pde_t *)kalloc_zeroed()) == 0)
+      return 0;
+    *pte = PA2PTE(pagetable) | PTE_V;
   }
   return &pagetable[PX(0, va)];
 }
@@ -114,19 +203,23 @@ uint64
 walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
-  uint64 pa;
+  uint64 pa, off = 0;
 
   if (va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
-  if (pte == 0)
+  pte = walkl1(pagetable, va, 0);
+  if (pte == 0 || (*pte & PTE_V) == 0)
     return 0;
+  if (PTE_LEAF(*pte))
+    off = PGROUNDDOWN(va) & (MEGAPGSIZE - 1);
+  else
+    pte = &((pagetable_t)PTE2PA(*pte))[PX(0, va)];
   if ((*pte & PTE_V) == 0)
     return 0;
   if ((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  pa = PTE2PA(*pte) + off;
   return pa;
 }
 
@@ -143,6 +236,9 @@ void kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 // physical addresses starting at pa. va and size might not
 // be page-aligned. Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
+// Each 2MB-aligned stretch whose va and pa are both aligned is
+// mapped with a single megapage PTE, unless that part of the
+// address space already has a level-0 page table.
 int mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
   uint64 a, last;
@@ -155,6 +251,20 @@ int mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   last = PGROUNDDOWN(va + size - 1);
   for (;;)
   {
+    if ((a % MEGAPGSIZE) == 0 && (pa % MEGAPGSIZE) == 0 && last - a >= MEGAPGSIZE - PGSIZE)
+    {
+      if ((pte = walkl1(pagetable, a, 1)) == 0)
+        return -1;
+      if ((*pte & PTE_V) == 0)
+      {
+        *pte = PA2PTE(pa) | perm | PTE_V;
+        if (a + MEGAPGSIZE - PGSIZE == last)
+          break;
+        a += MEGAPGSIZE;
+        pa += MEGAPGSIZE;
+        continue;
+      }
+    }
     if ((pte = walk(pagetable, a, 1)) == 0)
       return -1;
     if (*pte & PTE_V)
@@ -168,9 +278,56 @@ int mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
+// Replace the megapage mapping that covers va, if any, with
+// a level-0 page table of 512 PTEs that map the same memory
+// with the same permissions, so that part of it can be
+// unmapped, copied or protected on its own. Each 4KB page
+// of a megapage already has its own reference count.
+// Returns 0 on success, -1 if out of memory.
+int splitmega(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  pagetable_t pt;
+  uint64 pa;
+  uint flags;
+
+  if ((pte = megapte(pagetable, va)) == 0)
+    return 0;
+  if ((pt = (pagetable_t)kalloc()) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte);
+  for (int i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i * PGSIZE) | flags;
+  *pte = PA2PTE(pt) | PTE_V;
+  uvmflushva(va);
+  return 0;
+}
+
+// Drop a megapage mapping's references to its 512 pages.
+// Unshared megapages go back to the allocator as one block.
+static void
+kputmega(uint64 pa)
+{
+  int i;
+
+  for (i = 0; i < 512; i++)
+    if (getref((void *)(pa + i * PGSIZE)) != 1)
+      break;
+  if (i == 512)
+  {
+    kfree_pages((void *)pa, MEGAORDER);
+    return;
+  }
+  for (i = 0; i < 512; i++)
+    kput((void *)(pa + i * PGSIZE));
+}
+
 // Remove npages of mappings starting from va. va must be
 // page-aligned. The mappings must exist.
-// Optionally free the physical memory.
+// Optionally drop the mapping's reference to the physical
+// memory, freeing pages that are no longer shared.
+// A megapage only partly inside the range is split first.
 void uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
   uint64 a;
@@ -181,20 +338,43 @@ void uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 
   for (a = va; a < va + npages * PGSIZE; a += PGSIZE)
   {
+    if ((pte = megapte(pagetable, a)) != 0)
+    {
+      if ((a % MEGAPGSIZE) == 0 && a + MEGAPGSIZE <= va + npages * PGSIZE)
+      {
+        if (do_free)
+          kputmega(PTE2PA(*pte));
+        *pte = 0;
+        uvmflushva(a);
+        a += MEGAPGSIZE - PGSIZE;
+        continue;
+      }
+      if (splitmega(pagetable, a) < 0)
+        panic("uvmunmap: split");
+    }
     if ((pte = walk(pagetable, a, 0)) == 0)
       continue;
       // panic("uvmunmap: walk");
     if ((*pte & PTE_V) == 0)
+    {
+      // a swapped-out page: drop its swap slot.
+      if ((*pte & PTE_SWAP) && do_free)
+      {
+        swapfree(PTE2SLOT(*pte));
+        *pte = 0;
+      }
       continue;
       // panic("uvmunmap: not mapped");
+    }
     if (PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if (do_free)
     {
       uint64 pa = PTE2PA(*pte);
-      kfree((void *)pa);
+      kput((void *)pa);
     }
     *pte = 0;
+    uvmflushva(a);
   }
 }
 
@@ -204,10 +384,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t)kalloc();
+  pagetable = (pagetable_t)kalloc_zeroed();
   if (pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -220,8 +399,7 @@ void uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if (sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W | PTE_R | PTE_X | PTE_U);
   memmove(mem, src, sz);
 }
@@ -240,13 +418,29 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
   oldsz = PGROUNDUP(oldsz);
   for (a = oldsz; a < newsz; a += PGSIZE)
   {
-    mem = kalloc();
+    // whole, aligned 2MB stretches get a megapage when the
+    // allocator has a contiguous block to spare.
+    if ((a % MEGAPGSIZE) == 0 && a + MEGAPGSIZE <= PGROUNDUP(newsz) &&
+        (mem = kalloc_pages(MEGAORDER)) != 0)
+    {
+      memset(mem, 0, MEGAPGSIZE);
+      if (mappages(pagetable, a, MEGAPGSIZE, (uint64)mem, PTE_R | PTE_U | xperm) != 0)
+      {
+        kfree_pages(mem, MEGAORDER);
+        uvmdealloc(pagetable, a, oldsz);
+        return 0;
+      }
+      a += MEGAPGSIZE - PGSIZE;
+      continue;
+    }
+    mem = kalloc_zeroed();
+    if (mem == 0 && reclaim(NRECLAIM) > 0)
+      mem = kalloc_zeroed();
     if (mem == 0)
     {
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if (mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R | PTE_U | xperm) != 0)
     {
       kfree(mem);
@@ -276,102 +470,173 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
   return newsz;
 }
 
-// Recursively free page-table pages.
-// All leaf mappings must already have been removed.
-void freewalk(pagetable_t pagetable)
+// Map zeroed memory at va, the first touch of a page of the
+// heap [lo, hi), which sbrk() grows without allocating. If
+// the aligned 2MB around va lies inside the heap and none of
+// it is mapped yet, it gets a whole megapage, as uvmalloc()
+// would have given it, when the allocator has a contiguous
+// block to spare. Returns 0, -1 if out of memory, or 1 if
+// va is already mapped or swapped out.
+int uvmzero(pagetable_t pagetable, uint64 va, uint64 lo, uint64 hi)
+{
+  uint64 m = va & ~(MEGAPGSIZE - 1);
+  pte_t *pte;
+  char *mem;
+
+  va = PGROUNDDOWN(va);
+  if ((pte = walkl1(pagetable, va, 0)) != 0 && (*pte & PTE_V))
+  {
+    if (PTE_LEAF(*pte))
+      return 1;
+    if ((pte = walk(pagetable, va, 0)) != 0 && *pte != 0)
+      return 1;
+  }
+  else if (m >= lo && m + MEGAPGSIZE <= hi && (mem = kalloc_pages(MEGAORDER)) != 0)
+  {
+    memset(mem, 0, MEGAPGSIZE);
+    if (mappages(pagetable, m, MEGAPGSIZE, (uint64)mem, PTE_R | PTE_W | PTE_U) == 0)
+      return 0;
+    kfree_pages(mem, MEGAORDER);
+  }
+
+  if ((mem = kalloc_zeroed()) == 0)
+    return -1;
+  if (mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_R | PTE_W | PTE_U) != 0)
+  {
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Free a page table and everything below it in one pass:
+// the user pages it maps (dropping this mapping's reference,
+// as uvmunmap() does), their swap slots, and the page-table
+// pages themselves. pagetable is at the given level and maps
+// from va. Every leaf must lie below sz. Pages whose last
+// reference goes are collected on *batch.
+static void
+freewalk(pagetable_t pagetable, int level, uint64 va, uint64 sz, struct run **batch)
 {
   // there are 2^9 = 512 PTEs in a page table.
   for (int i = 0; i < 512; i++)
   {
     pte_t pte = pagetable[i];
-    if ((pte & PTE_V) && (pte & (PTE_R | PTE_W | PTE_X)) == 0)
+    uint64 a = va + ((uint64)i << PXSHIFT(level));
+
+    if ((pte & PTE_V) == 0)
+    {
+      if (pte & PTE_SWAP)
+        swapfree(PTE2SLOT(pte));
+    }
+    else if (PTE_LEAF(pte) == 0)
     {
       // this PTE points to a lower-level page table.
-      uint64 child = PTE2PA(pte);
-      freewalk((pagetable_t)child);
-      pagetable[i] = 0;
+      freewalk((pagetable_t)PTE2PA(pte), level - 1, a, sz, batch);
     }
-    else if (pte & PTE_V)
+    else
     {
-      panic("freewalk: leaf");
+      if (a >= sz || level > 1)
+        panic("freewalk: leaf");
+      // a megapage at level 1 covers 512 pages.
+      for (int k = 0; k < (level ? 512 : 1); k++)
+        kbatch_put(batch, (void *)(PTE2PA(pte) + k * PGSIZE));
     }
   }
-  kfree((void *)pagetable);
+  kbatch_put(batch, (void *)pagetable);
 }
 
-// Free user memory pages,
-// then free page-table pages.
+// Free user memory pages below sz and the page-table
+// pages, handing them all to the allocator together.
+// Mappings above sz (the trampoline and trapframe) must
+// already have been removed.
 void uvmfree(pagetable_t pagetable, uint64 sz)
 {
-  if (sz > 0)
-    uvmunmap(pagetable, 0, PGROUNDUP(sz) / PGSIZE, 1);
-  freewalk(pagetable);
+  struct run *batch = 0;
+
+  freewalk(pagetable, 2, 0, PGROUNDUP(sz), &batch);
+  kbatch_free(batch);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, share
+// its memory with a child's page table.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
-  uint64 pa, i;
-  uint flags;
-  char *mem;
-
-  for (i = 0; i < sz; i += PGSIZE)
-  {
-    if ((pte = walk(old, i, 0)) == 0)
-      continue;
-      // panic("uvmcopy: pte should exist");
-    if ((*pte & PTE_V) == 0)
-      continue;
-      // panic("uvmcopy: page not present");
-    pa = PTE2PA(*pte);
-    flags = PTE_FLAGS(*pte);
-    if ((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char *)pa, PGSIZE);
-    if (mappages(new, i, PGSIZE, (uint64)mem, flags) != 0)
-    {
-      kfree(mem);
-      goto err;
-    }
-  }
-  return 0;
-
-err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
-  return -1;
+  return _uvmcopy(old, new, sz, 0);
 }
 
+// Like uvmcopy(), but only from address start up. Nothing is
+// copied: every resident page, megapages included, is mapped
+// in the child too and gains a reference, and writable pages
+// become read-only PTE_COW pages in both page tables, so that
+// the first write by either side copies it in cowfault().
+// The dirty bit stays in both, so that reclaim never drops a
+// page that differs from its file.
 int _uvmcopy(pagetable_t old, pagetable_t new, uint64 sz, uint64 start)
 {
-  pte_t *pte;
+  pte_t *pte, *npte;
   uint64 pa, i;
-  uint flags;
-  char *mem;
+  int mega, npages;
 
-  for (i = start; i < sz; i += PGSIZE)
+  for (i = start; i < sz; i += npages * PGSIZE)
   {
-    if ((pte = walk(old, i, 0)) == 0)
+    npages = 1;
+    mega = 0;
+    if ((pte = megapte(old, i)) != 0)
+    {
+      if ((i % MEGAPGSIZE) != 0 || i + MEGAPGSIZE > sz)
+      {
+        // only part of it is being shared.
+        if (splitmega(old, i) < 0)
+          goto err;
+        pte = walk(old, i, 0);
+      }
+      else
+      {
+        mega = 1;
+        npages = MEGAPGSIZE / PGSIZE;
+      }
+    }
+    else if ((pte = walk(old, i, 0)) == 0)
+    {
       continue;
       // panic("uvmcopy: pte should exist");
+    }
     if ((*pte & PTE_V) == 0)
+    {
+      // a swapped-out page: the child shares the swap slot.
+      if (*pte & PTE_SWAP)
+      {
+        if ((npte = walk(new, i, 1)) == 0)
+          goto err;
+        swapdup(PTE2SLOT(*pte));
+        *npte = *pte;
+      }
       continue;
       // panic("uvmcopy: page not present");
+    }
+    if (*pte & PTE_W)
+    {
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+      uvmflushva(i);
+    }
     pa = PTE2PA(*pte);
-    flags = PTE_FLAGS(*pte);
-    if ((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char *)pa, PGSIZE);
-    if (mappages(new, i, PGSIZE, (uint64)mem, flags) != 0)
+    if (mega)
+    {
+      if ((npte = walkl1(new, i, 1)) == 0 || *npte != 0)
+        goto err;
+    }
+    else if ((npte = walk(new, i, 1)) == 0)
     {
-      kfree(mem);
       goto err;
     }
+    if (*npte & PTE_V)
+      panic("uvmcopy: remap");
+    *npte = *pte;
+    for (int k = 0; k < npages; k++)
+      incref((void *)(pa + k * PGSIZE));
   }
   return 0;
 
@@ -386,114 +651,308 @@ void uvmclear(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
 
+  if (splitmega(pagetable, va) < 0)
+    panic("uvmclear: split");
   pte = walk(pagetable, va, 0);
   if (pte == 0)
     panic("uvmclear");
   *pte &= ~PTE_U;
 }
 
-int check_vmas(uint64 addr)
+// Change the permissions of the present pages of npages
+// starting at va to perm (PTE_R and PTE_W bits), for
+// mprotect(). In a private mapping a page that is still
+// shared gets PTE_COW rather than PTE_W, so that a write
+// copies it; and a page that loses PTE_W loses PTE_COW too,
+// or cowfault() would make it writable again.
+void uvmprotect(pagetable_t pagetable, uint64 va, uint64 npages, int perm, int private)
+{
+  pte_t *pte;
+  uint64 pa;
+  int p;
+
+  for (uint64 a = va; a < va + npages * PGSIZE; a += PGSIZE)
+  {
+    if ((pte = walk(pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
+    pa = PTE2PA(*pte);
+    p = perm;
+    if ((p & PTE_W) && private && getref((void *)pa) > 1)
+      p = (p & ~PTE_W) | PTE_COW;
+    *pte = (*pte & ~(PTE_R | PTE_W | PTE_X | PTE_COW)) | p;
+    uvmflushva(a);
+  }
+}
+
+// Resolve a write fault at va on a present PTE_COW page, the
+// one fault handler for pages shared by fork, the page cache
+// and private mappings. If the page is still shared, give this
+// page table a private copy and drop its reference to the
+// shared page with kput(); otherwise this is the last sharer
+// and the page is just made writable again. Deciding on the
+// reference count and dropping it are not a race: if another
+// sharer lets go at the same time, exactly one kput() sees the
+// count reach zero. A shared megapage is split first, so that
+// only the 4KB page written is copied.
+// Returns 0 on success, -1 if out of memory, and 1 if va is
+// not a copy-on-write page.
+int cowfault(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint64 t0 = r_time();
+  uint flags;
+  char *mem;
+
+  va = PGROUNDDOWN(va);
+  if (va >= MAXVA || (pte = walk(pagetable, va, 0)) == 0 ||
+      (*pte & (PTE_V | PTE_COW)) != (PTE_V | PTE_COW))
+    return 1;
+  if (megapte(pagetable, va))
+  {
+    if (splitmega(pagetable, va) < 0)
+      return -1;
+    pte = walk(pagetable, va, 0);
+  }
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte);
+
+  if (getref((void *)pa) == 1)
+  {
+    *pte = (*pte & ~PTE_COW) | PTE_W;
+    uvmflushva(va);
+    faultcount(myproc(), FAULT_COW, 0, t0);
+    return 0;
+  }
+
+  if ((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char *)pa, PGSIZE);
+  *pte = PA2PTE(mem) | (flags & ~PTE_COW) | PTE_W;
+  uvmflushva(va);
+  kput((void *)pa);
+  faultcount(myproc(), FAULT_COW, 0, t0);
+  return 0;
+}
+
+// Drop this hart's TLB entries for user address va, after its
+// PTE changed: a user page table's entries are tagged with its
+// ASID and survive switches of page table (see asid.c).
+void uvmflushva(uint64 va)
+{
+  sfence_vma_va(va);
+#ifdef SUMCOPY
+  sfence_vma_va(UALIAS(va));
+#endif
+}
+
+// Was a fault on va, for access PTE_R, PTE_W or PTE_X, caused
+// by a TLB entry older than its PTE, which already allows the
+// access? The PTEs of pages being mapped are not flushed, since
+// the TLB holds no entries for invalid ones, but a hart may. If
+// so, drop the stale entry so the access can be retried.
+int uvmstale(pagetable_t pagetable, uint64 va, int access)
+{
+  pte_t *pte;
+  int need = PTE_V | PTE_U | access;
+
+  if (va >= MAXVA || (pte = walk(pagetable, va, 0)) == 0 || (*pte & need) != need)
+    return 0;
+  uvmflushva(va);
+  return 1;
+}
+
+// Fault in the page at addr for a copy to (write) or from
+// user memory. Returns 0 if it is now mapped, -1 if not.
+// A caller holding a spinlock cannot sleep, so for it only a
+// copy-on-write page is handled: a swapped-out page is not read
+// back in, and no page is allocated, since that may reclaim
+// (and write to swap) or read the file.
+int check_vmas(uint64 addr, int write)
 {
   struct proc *p = myproc();
+  int atomic = holdingany();
+  pte_t *pte;
+
+  if (atomic && addr < MAXVA && (pte = walk(p->pagetable, addr, 0)) != 0 &&
+      (*pte & (PTE_V | PTE_SWAP)) == PTE_SWAP)
+    return -1;
+
+  // a swapped-out anonymous page.
+  int sw = swapin(p->pagetable, addr);
+  if (sw < 0)
+  {
+    printf("usertrap(): No physical pages available. pid=%d\n", p->pid);
+    setkilled(p);
+    return -1;
+  }
+  if (sw > 0)
+    return 0;
+
+  // a present page can only fault because it is a
+  // read-only copy-on-write page being written.
+  uint64 phy = walkaddr(p->pagetable, addr);
+  if (phy)
+  {
+    int cow = write ? cowfault(p->pagetable, addr) : 1;
+    if (cow > 0)
+      return -1;
+    if (cow < 0)
+    {
+      printf("usertrap(): No physical pages available. pid=%d\n", p->pid);
+      setkilled(p);
+      return -1;
+    }
+    return 0;
+  }
+  if (atomic)
+    return -1;
+
+  // the handlers below only setkilled() the process if they
+  // run out of memory or the file cannot be read: the page is
+  // there if it got mapped.
   if (addr >= p->text.addr && addr < (p->text.addr + p->text.size))
   {
     int prot = PTE_R | PTE_X;
-    allocPhysicalVMA(&(p->text), p, addr, prot | PTE_U);
-    return 0;
+    allocPhysicalVMA(&(p->text), p, addr, prot | PTE_U, 0);
   }
   else if (addr >= p->data.addr && addr < (p->data.addr + p->data.size))
   {
     int prot = PTE_R | PTE_W;
-    allocPhysicalVMA(&(p->data), p, addr, prot | PTE_U);
-    return 0;
+    allocPhysicalVMA(&(p->data), p, addr, prot | PTE_U, write);
   }
   else
   {
-    int solved = 0;
-    int cow = 0;
-
-    uint64 phy = walkaddr(p->pagetable, addr);
-    if (phy)
+    struct vma *vma = findvma(p, addr);
+    if (vma)
     {
-      for (int i = 0; i < PER_PROCESS_VMAS && !solved; i++)
-      {
-        if (p->vmas[i] == 0)
-          continue;
-
-        if (addr >= p->vmas[i]->addr && addr < (p->vmas[i]->addr + p->vmas[i]->size))
-        {
-          cow = 1;
-          break;
-        }
-      }
-      if (cow)
-      {
-        int ref = getref((void *)phy);
-        if (ref > 1)
-        {
-          char *new_phy = kalloc();
-          if (new_phy == 0)
-          {
-            printf("usertrap(): No physical pages available. pid=%d\n", p->pid);
-            setkilled(p);
-          }
-          memcpy(new_phy, (void *)phy, PGSIZE);
-          uint64 *pte = walk(p->pagetable, addr, 0);
-          *pte = *pte & ~(PTE_V);
-          if (mappages(p->pagetable, PGROUNDDOWN(addr), PGSIZE, (uint64)new_phy, PTE_FLAGS(*pte) | PTE_W) < 0)
-          {
-            kfree(new_phy);
-            printf("usertrap(): Could not map physical to virtual address, pid=%d\n", p->pid);
-            setkilled(p);
-          }
-          decref((void *)phy);
-        }
-        if (ref == 1)
-        {
-          uint64 *pte = walk(p->pagetable, addr, 0);
-          *pte = *pte | PTE_W;
-        }
-        solved = 1;
-      }
+      int prot = vmaperm(vma);
+      allocPhysicalVMA(vma, p, addr, prot | PTE_U, write);
     }
-    for (int i = 0; i < PER_PROCESS_VMAS && !solved; i++)
+    else if (addr >= p->sz || allocHeap(p, addr) != 0)
     {
-      if (p->vmas[i] == 0)
-        continue;
+      return -1;
+    }
+  }
+  return walkaddr(p->pagetable, addr) ? 0 : -1;
+}
 
-      if (addr >= p->vmas[i]->addr && addr < (p->vmas[i]->addr + p->vmas[i]->size))
-      {
-        int prot;
-        switch (p->vmas[i]->prot)
-        {
-        case (PROT_READ):
-          prot = PTE_R;
-          break;
-        case (PROT_WRITE):
-          prot = PTE_W;
-          break;
-        case (PROT_RW):
-          prot = PTE_R | PTE_W;
-          break;
-        default:
-          prot = 0;
-        }
+// The copy functions below walk the user page table and go
+// through the kernel's direct map. Built with SUMCOPY, they
+// first try the user addresses themselves: a process's kernel
+// page table (p->kpagetable, its satp while it runs in the
+// kernel) maps its user memory at UALIAS(va), see kvmuser(),
+// and with sstatus.SUM set usercopy.S reaches it with plain
+// loads and stores. The hardware then sets PTE_A and PTE_D.
+// A page that is not faulted in, swapped out, copy-on-write
+// or not mapped at all faults; kerneltrap() makes the copy
+// return -1, and it is redone by walking the page table,
+// which handles all of those. The alias is refreshed after
+// that, since the user page table may have gained top-level
+// entries.
+//
+// Only the trampoline and trapframe are kept out of reach;
+// unlike the walk, SUM does not stop at the stack guard page,
+// which is merely not PTE_U.
+#ifdef SUMCOPY
+int usercopy(char *, char *, uint64);
+int usercopystr(char *, char *, uint64);
+
+// Can [va, va+len) of pagetable be reached through the alias?
+static int
+sumcopyok(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
 
-        allocPhysicalVMA(p->vmas[i], p, addr, prot | PTE_U);
+  return p != 0 && p->kpagetable != 0 && pagetable == p->pagetable &&
+         va < TRAPFRAME && len <= TRAPFRAME - va;
+}
 
-        solved = 1;
-      }
-    }
-    if (solved)
-      return 0;
-  }
-  return -1;
+// After redoing a copy that faulted in usercopy.S by walking:
+// pick up the user page table's top level, and drop the TLB
+// entries for the PTEs the walk changed.
+static void
+sumcopysync(void)
+{
+  struct proc *p = myproc();
+
+  kvmuser(p->kpagetable, p->pagetable);
 }
+#endif
 
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
 int copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
+{
+#ifdef SUMCOPY
+  int r;
+
+  if (sumcopyok(pagetable, dstva, len))
+  {
+    if (usercopy((char *)UALIAS(dstva), src, len) == 0)
+      return 0;
+    r = copyout_walk(pagetable, dstva, src, len);
+    sumcopysync();
+    return r;
+  }
+#endif
+  return copyout_walk(pagetable, dstva, src, len);
+}
+
+// Copy from user to kernel.
+// Copy len bytes to dst from virtual address srcva in a given page table.
+// Return 0 on success, -1 on error.
+int copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+{
+#ifdef SUMCOPY
+  int r;
+
+  if (sumcopyok(pagetable, srcva, len))
+  {
+    if (usercopy(dst, (char *)UALIAS(srcva), len) == 0)
+      return 0;
+    r = copyin_walk(pagetable, dst, srcva, len);
+    sumcopysync();
+    return r;
+  }
+#endif
+  return copyin_walk(pagetable, dst, srcva, len);
+}
+
+// Copy a null-terminated string from user to kernel.
+// Copy bytes to dst from virtual address srcva in a given page table,
+// until a '\0', or max.
+// Return 0 on success, -1 on error.
+int copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
+{
+#ifdef SUMCOPY
+  int r;
+
+  if (sumcopyok(pagetable, srcva, 1))
+  {
+    // no further than the trapframe, where the walk fails too.
+    if ((r = usercopystr(dst, (char *)UALIAS(srcva), max < TRAPFRAME - srcva ? max : TRAPFRAME - srcva)) >= 0)
+      return -r;
+    r = copyinstr_walk(pagetable, dst, srcva, max);
+    sumcopysync();
+    return r;
+  }
+#endif
+  return copyinstr_walk(pagetable, dst, srcva, max);
+}
+
+// The *_walk() copies below may sleep in check_vmas(), during
+// which reclaim() may take pages of this process; so pa0 is
+// always walked again after it, and no physical address is
+// kept across the call (see reclaim.c).
+
+// copyout() by walking the page table.
+// The page is written through the kernel's direct map, so
+// mark it accessed and dirty as a user store would, or
+// reclaim would think it still matches its file.
+static int
+copyout_walk(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
 
@@ -501,13 +960,18 @@ int copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
   {
     va0 = PGROUNDDOWN(dstva);
     pa0 = walkaddr(pagetable, va0);
-    if (pa0 == 0)
+    if (pa0 == 0 || (*walk(pagetable, va0, 0) & PTE_W) == 0)
     {
-      int vmas = check_vmas(va0);
+      // not yet faulted in, or a copy-on-write page that
+      // must not be written through the shared frame.
+      int vmas = check_vmas(va0, 1);
       if (vmas == -1)
         return -1;
       pa0 = walkaddr(pagetable, va0);
+      if (pa0 == 0 || (*walk(pagetable, va0, 0) & PTE_W) == 0)
+        return -1;
     }
+    *walk(pagetable, va0, 0) |= PTE_A | PTE_D;
     n = PGSIZE - (dstva - va0);
     if (n > len)
       n = len;
@@ -520,10 +984,9 @@ int copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
   return 0;
 }
 
-// Copy from user to kernel.
-// Copy len bytes to dst from virtual address srcva in a given page table.
-// Return 0 on success, -1 on error.
-int copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+// copyin() by walking the page table.
+static int
+copyin_walk(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
 
@@ -533,10 +996,12 @@ int copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
     pa0 = walkaddr(pagetable, va0);
     if (pa0 == 0)
     {
-      int vmas = check_vmas(va0);
+      int vmas = check_vmas(va0, 0);
       if (vmas == -1)
         return -1;
       pa0 = walkaddr(pagetable, va0);
+      if (pa0 == 0)
+        return -1;
     }
     n = PGSIZE - (srcva - va0);
     if (n > len)
@@ -550,11 +1015,9 @@ int copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   return 0;
 }
 
-// Copy a null-terminated string from user to kernel.
-// Copy bytes to dst from virtual address srcva in a given page table,
-// until a '\0', or max.
-// Return 0 on success, -1 on error.
-int copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
+// copyinstr() by walking the page table.
+static int
+copyinstr_walk(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
   uint64 n, va0, pa0;
   int got_null = 0;
@@ -565,10 +1028,12 @@ int copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
     pa0 = walkaddr(pagetable, va0);
     if (pa0 == 0)
     {
-      int vmas = check_vmas(va0);
+      int vmas = check_vmas(va0, 0);
       if (vmas == -1)
         return -1;
       pa0 = walkaddr(pagetable, va0);
+      if (pa0 == 0)
+        return -1;
     }
     n = PGSIZE - (srcva - va0);
     if (n > max)
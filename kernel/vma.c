@@ -0,0 +1,191 @@
+// Per-process index of mmap VMAs.
+//
+// p->vmas is an array of pointers to the process's mmap VMAs,
+// sorted by address, in a block of 2^p->vmaorder pages from
+// kalloc_pages() that doubles when it fills up. findvma()
+// remembers the last VMA it found, since faults tend to come
+// in runs on the same mapping, and otherwise does a binary
+// search. The VMAs themselves come from vmacache (proc.c).
+//
+// Only the process itself changes its index (mmap, munmap,
+// fork, exit), so no lock is needed to read it from its own
+// page-fault path. reclaim() reads the index of a sleeping
+// process, which is never in the middle of changing it.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fcntl.h"
+
+#define VMASPERPAGE (PGSIZE / sizeof(struct vma *))
+
+static int
+vmacap(struct proc *p)
+{
+  return p->vmas ? VMASPERPAGE << p->vmaorder : 0;
+}
+
+// Return the index of the first VMA of p that ends after addr,
+// or p->nvma if there is none.
+static int
+vmasearch(struct proc *p, uint64 addr)
+{
+  int lo = 0, hi = p->nvma, mid;
+
+  while (lo < hi)
+  {
+    mid = (lo + hi) / 2;
+    if (p->vmas[mid]->addr + p->vmas[mid]->size <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Return the mmap VMA of p that contains addr, or 0.
+struct vma *
+findvma(struct proc *p, uint64 addr)
+{
+  struct vma *v = p->lastvma;
+  int i;
+
+  if (v && addr >= v->addr && addr < v->addr + v->size)
+    return v;
+  i = vmasearch(p, addr);
+  if (i == p->nvma || addr < p->vmas[i]->addr)
+    return 0;
+  v = p->vmas[i];
+  p->lastvma = v;
+  return v;
+}
+
+// Return the lowest mmap VMA of p that overlaps [start, end), or 0.
+struct vma *
+vmaoverlap(struct proc *p, uint64 start, uint64 end)
+{
+  int i = vmasearch(p, start);
+
+  if (i == p->nvma || p->vmas[i]->addr >= end)
+    return 0;
+  return p->vmas[i];
+}
+
+// Return the address of a free, page-aligned range of len
+// bytes for a new mapping, between the top of the heap and
+// the trapframe, or 0 if there is none. Just below the lowest
+// mapping is tried first; after that, the holes munmap() left,
+// from the top down.
+uint64
+vmagap(struct proc *p, uint64 len)
+{
+  uint64 low = PGROUNDUP(p->sz), top = TRAPFRAME, end;
+
+  len = PGROUNDUP(len);
+  if (p->nvma > 0)
+    top = p->vmas[0]->addr;
+  if (top >= low + len)
+    return top - len;
+
+  top = TRAPFRAME;
+  for (int i = p->nvma - 1; i >= 0; i--)
+  {
+    end = PGROUNDUP(p->vmas[i]->addr + p->vmas[i]->size);
+    if (top >= end + len)
+      return top - len;
+    top = p->vmas[i]->addr;
+  }
+  return 0;
+}
+
+// The PTE permission bits for pages of v. PROT_WRITE alone
+// also gets PTE_R, since W without R is reserved in Sv39.
+int
+vmaperm(struct vma *v)
+{
+  switch (v->prot)
+  {
+  case PROT_READ:
+    return PTE_R;
+  case PROT_WRITE:
+  case PROT_RW:
+    return PTE_R | PTE_W;
+  default:
+    return 0;
+  }
+}
+
+// Make room in p's index for n more VMAs, so that inserting
+// them cannot fail. Returns 0, or -1 if the index cannot grow.
+int
+vmareserve(struct proc *p, int n)
+{
+  struct vma **vmas;
+  int order;
+
+  if (p->nvma + n <= vmacap(p))
+    return 0;
+  order = p->vmas ? p->vmaorder : 0;
+  while ((VMASPERPAGE << order) < p->nvma + n)
+    order++;
+  if ((vmas = kalloc_pages(order)) == 0)
+    return -1;
+  if (p->vmas)
+  {
+    memmove(vmas, p->vmas, p->nvma * sizeof(struct vma *));
+    kfree_pages(p->vmas, p->vmaorder);
+  }
+  p->vmas = vmas;
+  p->vmaorder = order;
+  return 0;
+}
+
+// Add v, whose address and size are set and which must not
+// overlap another VMA, to p's index. Returns 0, or -1 if
+// the index cannot grow.
+int
+vmainsert(struct proc *p, struct vma *v)
+{
+  int i;
+
+  if (vmareserve(p, 1) < 0)
+    return -1;
+
+  i = vmasearch(p, v->addr);
+  memmove(&p->vmas[i + 1], &p->vmas[i], (p->nvma - i) * sizeof(struct vma *));
+  p->vmas[i] = v;
+  p->nvma++;
+  return 0;
+}
+
+// Take v out of p's index.
+void
+vmaremove(struct proc *p, struct vma *v)
+{
+  int i;
+
+  i = vmasearch(p, v->addr);
+  if (i == p->nvma || p->vmas[i] != v)
+    panic("vmaremove");
+  p->nvma--;
+  memmove(&p->vmas[i], &p->vmas[i + 1], (p->nvma - i) * sizeof(struct vma *));
+  if (p->lastvma == v)
+    p->lastvma = 0;
+}
+
+// Free the index of p, which must have no VMAs left.
+void
+vmafree(struct proc *p)
+{
+  if (p->nvma)
+    panic("vmafree");
+  if (p->vmas)
+    kfree_pages(p->vmas, p->vmaorder);
+  p->vmas = 0;
+  p->vmaorder = 0;
+  p->lastvma = 0;
+}
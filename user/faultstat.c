@@ -0,0 +1,61 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fcntl.h"
+#include "kernel/faultstat.h"
+
+// faultstat [pid [file]]
+// Write the page fault counters of process pid, or of the whole
+// system if pid is 0 or not given, as ';'-separated CSV: one row
+// per fault type with its minor and major faults, the rdtime
+// ticks spent serving them, and the latency histogram, bucket i
+// counting faults that took [2^i, 2^(i+1)) ticks.
+
+static char *types[NFAULTTYPE] = {
+	[FAULT_TEXT] "text",
+	[FAULT_DATA] "data",
+	[FAULT_MMAP] "mmap",
+	[FAULT_ANON] "anon",
+	[FAULT_COW] "cow",
+};
+
+int main(int argc, char *argv[])
+{
+	struct faultstat fs;
+	int pid = 0, fd = 1;
+
+	if (argc > 3)
+	{
+		fprintf(2, "USAGE: %s [pid [csv_file]]\n", argv[0]);
+		exit(1);
+	}
+	if (argc > 1)
+		pid = atoi(argv[1]);
+	if (faultstat(pid, &fs) < 0)
+	{
+		fprintf(2, "faultstat: no process %d\n", pid);
+		exit(1);
+	}
+	if (argc > 2 && (fd = open(argv[2], O_CREATE | O_TRUNC | O_WRONLY)) < 0)
+	{
+		fprintf(2, "Cannot open file %s!\n", argv[2]);
+		exit(1);
+	}
+
+	fprintf(fd, "type;minor;major;ticks");
+	for (int b = 0; b < NFAULTHIST; b++)
+		fprintf(fd, ";h%d", b);
+	fprintf(fd, "\n");
+
+	for (int t = 0; t < NFAULTTYPE; t++)
+	{
+		fprintf(fd, "%s;%d;%d;%l", types[t], fs.minor[t], fs.major[t], fs.ticks[t]);
+		for (int b = 0; b < NFAULTHIST; b++)
+			fprintf(fd, ";%d", fs.hist[t][b]);
+		fprintf(fd, "\n");
+	}
+
+	if (fd != 1)
+		close(fd);
+	exit(0);
+}
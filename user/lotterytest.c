@@ -0,0 +1,101 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/pstat.h"
+
+// Lottery fairness: NGROUP groups of NPERGROUP CPU-bound
+// children, with 10, 20 and 30 tickets, should get shares of the
+// ticks that match their shares of the tickets, within TOLERANCE
+// percentage points. There are more children than harts, so the
+// draw matters on 1 CPU as on 8 (make CPUS=8 qemu).
+
+#define NGROUP 3
+#define NPERGROUP 8
+#define NCHILD (NGROUP * NPERGROUP)
+#define TOLERANCE 10
+#define RUNTICKS 300
+
+int pids[NCHILD];
+
+// Add up the ticks of each group's children.
+void group_ticks(int *ticks)
+{
+  struct pstat ps;
+
+  if (getpinfo(&ps) < 0)
+  {
+    printf("lotterytest: getpinfo failed\n");
+    exit(1);
+  }
+  for (int g = 0; g < NGROUP; g++)
+    ticks[g] = 0;
+  for (int i = 0; i < NPROC; i++)
+  {
+    if (!ps.inuse[i])
+      continue;
+    for (int c = 0; c < NCHILD; c++)
+      if (ps.pid[i] == pids[c])
+        ticks[c / NPERGROUP] += ps.ticks[i];
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  int before[NGROUP], after[NGROUP];
+  int total = 0, tickets = 0, failed = 0;
+
+  for (int c = 0; c < NCHILD; c++)
+  {
+    if ((pids[c] = fork()) < 0)
+    {
+      printf("lotterytest: fork failed\n");
+      exit(1);
+    }
+    if (pids[c] == 0)
+    {
+      settickets(10 * (c / NPERGROUP + 1));
+      for (;;)
+        ;
+    }
+  }
+
+  // let every child set its tickets before counting.
+  sleep(10);
+  group_ticks(before);
+  sleep(RUNTICKS);
+  group_ticks(after);
+
+  for (int c = 0; c < NCHILD; c++)
+  {
+    kill(pids[c]);
+    wait(0);
+  }
+
+  for (int g = 0; g < NGROUP; g++)
+  {
+    total += after[g] - before[g];
+    tickets += 10 * (g + 1);
+  }
+  if (total == 0)
+  {
+    printf("lotterytest: children did not run\n");
+    exit(1);
+  }
+  for (int g = 0; g < NGROUP; g++)
+  {
+    int got = (after[g] - before[g]) * 100 / total;
+    int want = 10 * (g + 1) * 100 / tickets;
+    printf("lotterytest: %d tickets: %d ticks, %d%% (want %d%%)\n",
+           10 * (g + 1), after[g] - before[g], got, want);
+    if (got < want - TOLERANCE || got > want + TOLERANCE)
+      failed = 1;
+  }
+  if (failed)
+  {
+    printf("lotterytest: FAILED\n");
+    exit(1);
+  }
+  printf("lotterytest: OK\n");
+  exit(0);
+}
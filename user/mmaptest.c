@@ -8,12 +8,26 @@
 
 void mmap_test();
 void fork_test();
+void many_test();
+void anon_test();
+void window_test();
+void msync_test();
+void madvise_test();
+void shm_test();
+void reclaim_test();
 char buf[BSIZE];
 
 int main(int argc, char *argv[])
 {
   mmap_test();
   fork_test();
+  many_test();
+  anon_test();
+  window_test();
+  msync_test();
+  madvise_test();
+  shm_test();
+  reclaim_test();
   printf("mmaptest: all tests succeeded\n");
   exit(0);
 }
@@ -241,21 +255,45 @@ void fork_test(void)
   if (p2 == MAP_FAILED)
     err("mmap (5)");
 
+  // a private page the parent has written, and so has a
+  // writable TLB entry for.
+  char *p3 = mmap(0, PGSIZE, PROT_RW, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p3 == MAP_FAILED)
+    err("mmap (6)");
+  *p3 = 'P';
+
   // read just 2nd page.
   if (*(p1 + PGSIZE) != 'A')
     err("fork mismatch (1)");
 
+  int fds[2];
+  char c;
+  if (pipe(fds) < 0)
+    err("pipe");
   if ((pid = fork()) < 0)
     err("fork");
   if (pid == 0)
   {
     _v1(p1);
     munmap(p1, PGSIZE); // just the first page
+    // once the parent has written its copy, ours must be unchanged.
+    close(fds[1]);
+    if (read(fds[0], &c, 1) != 1 || *p3 != 'P')
+      exit(1);
     exit(0);            // tell the parent that the mapping looks OK.
   }
 
+  close(fds[0]);
+  *p3 = 'Q';
+  if (write(fds[1], "x", 1) != 1)
+    err("write");
+  close(fds[1]);
+
   int status = -1;
   wait(&status);
+  if (*p3 != 'Q')
+    err("fork mismatch (2)");
+  munmap(p3, PGSIZE);
 
   if (status != 0)
   {
@@ -268,4 +306,470 @@ void fork_test(void)
   _v1(p2);
 
   printf("fork_test OK\n");
-}
\ No newline at end of file
+}
+
+//
+// map the file many more times than fit in one page of the
+// process's VMA index, and unmap the mappings out of order.
+//
+#define NMANY 600
+char *many[NMANY];
+
+void many_test(void)
+{
+  int fd;
+  int i;
+  const char *const f = "mmap.dur";
+
+  printf("many_test starting\n");
+  testname = "many_test";
+
+  makefile(f);
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  unlink(f);
+  for (i = 0; i < NMANY; i++)
+  {
+    many[i] = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (many[i] == MAP_FAILED)
+      err("mmap");
+  }
+  for (i = NMANY - 1; i >= 0; i--)
+    if (many[i][0] != 'A' || many[i][PGSIZE - 1] != 'A')
+      err("mismatch (1)");
+
+  // every other mapping, then the rest.
+  for (i = 0; i < NMANY; i += 2)
+    if (munmap(many[i], PGSIZE) == -1)
+      err("munmap (1)");
+  for (i = 1; i < NMANY; i += 2)
+    if (many[i][0] != 'A')
+      err("mismatch (2)");
+  for (i = 1; i < NMANY; i += 2)
+    if (munmap(many[i], PGSIZE) == -1)
+      err("munmap (2)");
+  close(fd);
+
+  printf("many_test OK\n");
+}
+
+//
+// anonymous memory: zero-filled on first touch, private or
+// shared with a child, and large malloc() blocks.
+//
+void anon_test(void)
+{
+  int i;
+  int pid;
+  int status = -1;
+  char *p, *q;
+
+  printf("anon_test starting\n");
+  testname = "anon_test";
+
+  p = mmap(0, PGSIZE * 4, PROT_RW, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap (1)");
+  for (i = 0; i < PGSIZE * 4; i++)
+    if (p[i] != 0)
+      err("not zero");
+  p[PGSIZE] = 'P';
+
+  q = mmap(0, PGSIZE * 4, PROT_RW, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (q == MAP_FAILED)
+    err("mmap (2)");
+
+  if ((pid = fork()) < 0)
+    err("fork");
+  if (pid == 0)
+  {
+    // q[PGSIZE * 2] was never touched before the fork.
+    q[PGSIZE * 2] = 'S';
+    p[PGSIZE] = 'C';
+    exit(0);
+  }
+  wait(&status);
+  if (status != 0)
+    err("child");
+  if (q[PGSIZE * 2] != 'S')
+    err("shared page not shared");
+  if (p[PGSIZE] != 'P')
+    err("private page not private");
+  if (munmap(p, PGSIZE * 4) == -1 || munmap(q, PGSIZE * 4) == -1)
+    err("munmap");
+
+  char *top = sbrk(0);
+  p = malloc(PGSIZE * 32);
+  if (p == 0)
+    err("malloc");
+  memset(p, 'M', PGSIZE * 32);
+  if (sbrk(0) != top)
+    err("large malloc grew the break");
+  free(p);
+
+  printf("anon_test OK\n");
+}
+
+//
+// windows of a file at non-zero offsets, MAP_FIXED and hint
+// addresses, munmap() of the middle of a mapping, and
+// mprotect().
+//
+void window_test(void)
+{
+  int fd;
+  int i;
+  int pid;
+  int status = 0;
+  const char *const f = "mmap.win";
+  char *p, *q;
+
+  printf("window_test starting\n");
+  testname = "window_test";
+
+  // page i of the file is filled with 'a' + i.
+  unlink(f);
+  if ((fd = open(f, O_RDWR | O_CREATE)) == -1)
+    err("open");
+  for (i = 0; i < 3 * PGSIZE / BSIZE; i++)
+  {
+    memset(buf, 'a' + i / (PGSIZE / BSIZE), BSIZE);
+    if (write(fd, buf, BSIZE) != BSIZE)
+      err("write");
+  }
+
+  p = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, PGSIZE);
+  if (p == MAP_FAILED)
+    err("mmap (1)");
+  if (p[0] != 'b' || p[PGSIZE - 1] != 'b')
+    err("offset");
+  if (mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 100) != MAP_FAILED)
+    err("unaligned offset accepted");
+  if (mmap(0, 0, PROT_READ, MAP_PRIVATE, fd, 0) != MAP_FAILED)
+    err("zero length accepted");
+
+  // replace it with the third page of the file.
+  if (mmap(p, PGSIZE, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 2 * PGSIZE) != p)
+    err("mmap (2)");
+  if (p[0] != 'c')
+    err("MAP_FIXED");
+
+  // a free hint is honoured.
+  q = mmap(p - 8 * PGSIZE, PGSIZE, PROT_READ, MAP_SHARED, fd, 0);
+  if (q != p - 8 * PGSIZE)
+    err("hint");
+  if (q[0] != 'a')
+    err("hint contents");
+  munmap(p, PGSIZE);
+  munmap(q, PGSIZE);
+
+  // writes to a shared window go back to their own offset.
+  p = mmap(0, 3 * PGSIZE, PROT_RW, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (3)");
+  p[2 * PGSIZE] = 'X';
+  if (munmap(p + PGSIZE, PGSIZE) == -1)
+    err("munmap middle");
+  if (p[0] != 'a' || p[2 * PGSIZE + 1] != 'c')
+    err("pages around the hole");
+  if (munmap(p, 3 * PGSIZE) == -1)
+    err("munmap (1)");
+  char c;
+  if (read(fd, &c, 1) != 0)
+    err("file grew");
+  close(fd);
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  for (i = 0; i < 2 * PGSIZE / BSIZE; i++)
+    if (read(fd, buf, BSIZE) != BSIZE)
+      err("read");
+  if (read(fd, &c, 1) != 1 || c != 'X')
+    err("writeback offset");
+  close(fd);
+  unlink(f);
+
+  // a read-only page cannot be written, in parent or child.
+  p = mmap(0, 2 * PGSIZE, PROT_RW, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap (4)");
+  p[0] = 'W';
+  p[PGSIZE] = 'W';
+  if (mprotect(p, PGSIZE, PROT_READ) == -1)
+    err("mprotect (1)");
+  if ((pid = fork()) < 0)
+    err("fork");
+  if (pid == 0)
+  {
+    p[PGSIZE] = 'V';  // still writable
+    p[0] = 'V';
+    exit(0);
+  }
+  wait(&status);
+  if (status == 0)
+    err("write to read-only page");
+  if (p[0] != 'W')
+    err("read-only page changed");
+  if (mprotect(p, 2 * PGSIZE, PROT_RW) == -1)
+    err("mprotect (2)");
+  p[0] = 'V';
+  if (mprotect(p + 2 * PGSIZE, PGSIZE, PROT_READ) != -1)
+    err("mprotect of unmapped memory");
+  munmap(p, 2 * PGSIZE);
+
+  printf("window_test OK\n");
+}
+
+//
+// msync() writes a shared mapping's changes to the file
+// while it is still mapped.
+//
+void msync_test(void)
+{
+  int fd;
+  const char *const f = "mmap.dur";
+  char *p;
+  char c;
+
+  printf("msync_test starting\n");
+  testname = "msync_test";
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  p = mmap(0, PGSIZE * 2, PROT_RW, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap");
+  close(fd);
+
+  p[1] = 'S';
+  if (msync(p, PGSIZE * 2, MS_ASYNC) == -1)
+    err("msync async");
+  if (msync(p, PGSIZE * 2, MS_SYNC) == -1)
+    err("msync sync");
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  if (read(fd, &c, 1) != 1 || read(fd, &c, 1) != 1 || c != 'S')
+    err("change not in file");
+  close(fd);
+  if (msync(p + PGSIZE * 2, PGSIZE, MS_SYNC) != -1)
+    err("msync of unmapped memory");
+  if (munmap(p, PGSIZE * 2) == -1)
+    err("munmap");
+
+  printf("msync_test OK\n");
+}
+
+//
+// madvise(): WILLNEED faults pages in ahead of use, DONTNEED
+// drops them, keeping shared changes, and the other hints
+// are accepted on part of a mapping.
+//
+void madvise_test(void)
+{
+  int fd;
+  int i, n;
+  const char *const f = "mmap.dur";
+  char *p;
+
+  printf("madvise_test starting\n");
+  testname = "madvise_test";
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  p = mmap(0, PGSIZE * 2, PROT_RW, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (1)");
+  close(fd);
+
+  if (madvise(p, PGSIZE * 2, MADV_WILLNEED) == -1)
+    err("willneed");
+  n = getpagefaults();
+  if (p[0] != 'A' || p[PGSIZE] != 'A')
+    err("mismatch (1)");
+  if (getpagefaults() != n)
+    err("willneed did not fault the pages in");
+
+  p[0] = 'D';
+  if (madvise(p, PGSIZE * 2, MADV_DONTNEED) == -1)
+    err("dontneed (1)");
+  if (p[0] != 'D')
+    err("dontneed lost a shared change");
+  if (getpagefaults() == n)
+    err("dontneed did not drop the pages");
+
+  if (madvise(p + PGSIZE, PGSIZE, MADV_SEQUENTIAL) == -1)
+    err("sequential");
+  if (madvise(p, PGSIZE, MADV_RANDOM) == -1)
+    err("random");
+  if (madvise(p, PGSIZE * 3, MADV_NORMAL) != -1)
+    err("madvise of unmapped memory");
+  if (p[1] != 'A' || p[PGSIZE] != 'A')
+    err("mismatch (2)");
+  if (munmap(p, PGSIZE * 2) == -1)
+    err("munmap (1)");
+
+  p = mmap(0, PGSIZE, PROT_RW, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap (2)");
+  memset(p, 'x', PGSIZE);
+  if (madvise(p, PGSIZE, MADV_DONTNEED) == -1)
+    err("dontneed (2)");
+  for (i = 0; i < PGSIZE; i++)
+    if (p[i] != 0)
+      err("dontneed anonymous page not zero");
+  munmap(p, PGSIZE);
+
+  printf("madvise_test OK\n");
+}
+
+//
+// shared memory segments: shared with a child through fork()
+// and by key, and freed with the last detach.
+//
+void shm_test(void)
+{
+  int id, pid;
+  int status = -1;
+  char *p, *q;
+
+  printf("shm_test starting\n");
+  testname = "shm_test";
+
+  if ((id = shmget(IPC_PRIVATE, PGSIZE * 2, 0)) < 0)
+    err("shmget (1)");
+  if ((p = shmat(id, 0, 0)) == MAP_FAILED)
+    err("shmat (1)");
+  if (p[0] != 0 || p[PGSIZE * 2 - 1] != 0)
+    err("not zero");
+
+  if ((pid = fork()) < 0)
+    err("fork");
+  if (pid == 0)
+  {
+    // the child inherits the attachment, and a second one
+    // maps the same pages.
+    if ((q = shmat(id, 0, 0)) == MAP_FAILED)
+      exit(1);
+    q[PGSIZE] = 'S';
+    p[0] = 'C';
+    exit(0);
+  }
+  wait(&status);
+  if (status != 0)
+    err("child");
+  if (p[0] != 'C' || p[PGSIZE] != 'S')
+    err("segment not shared");
+
+  if (shmget(1234, PGSIZE, IPC_CREAT) < 0)
+    err("shmget (2)");
+  if (shmget(1234, PGSIZE, IPC_CREAT | IPC_EXCL) != -1)
+    err("IPC_EXCL of an existing key");
+  if (shmget(4321, PGSIZE, 0) != -1)
+    err("shmget of a missing key");
+  if ((q = shmat(shmget(1234, 0, 0), 0, SHM_RDONLY)) == MAP_FAILED)
+    err("shmat (2)");
+  if (shmdt(q) == -1)
+    err("shmdt (1)");
+
+  if (shmdt(p + PGSIZE) != -1)
+    err("shmdt not at the start");
+  if (shmdt(p) == -1)
+    err("shmdt (2)");
+  if (shmat(id, 0, 0) != MAP_FAILED)
+    err("segment outlived its last detach");
+
+  // a mapping in a hole munmap() left in an attachment
+  // survives the detach.
+  if ((id = shmget(IPC_PRIVATE, PGSIZE * 2, 0)) < 0)
+    err("shmget (3)");
+  if ((p = shmat(id, 0, 0)) == MAP_FAILED)
+    err("shmat (3)");
+  if (munmap(p + PGSIZE, PGSIZE) == -1)
+    err("munmap");
+  q = mmap(p + PGSIZE, PGSIZE, PROT_RW, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (q != p + PGSIZE)
+    err("mmap in the hole");
+  *q = 'H';
+  if (shmdt(p) == -1)
+    err("shmdt (3)");
+  if (*q != 'H')
+    err("shmdt unmapped the hole");
+  munmap(q, PGSIZE);
+
+  printf("shm_test OK\n");
+}
+
+//
+// run the machine out of memory in a child, so that reclaim
+// sweeps the parent while it has private and shared anonymous
+// mappings and a shared memory segment, some pages written and
+// some only read; they must all keep their contents.
+//
+#define HOGMB 200
+
+void reclaim_test(void)
+{
+  int id, pid, i;
+  int status = -1;
+  char *a, *b, *s;
+
+  printf("reclaim_test starting\n");
+  testname = "reclaim_test";
+
+  a = mmap(0, PGSIZE * 4, PROT_RW, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (a == MAP_FAILED)
+    err("mmap (1)");
+  b = mmap(0, PGSIZE * 4, PROT_RW, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (b == MAP_FAILED)
+    err("mmap (2)");
+  if ((id = shmget(IPC_PRIVATE, PGSIZE * 2, 0)) < 0)
+    err("shmget");
+  if ((s = shmat(id, 0, 0)) == MAP_FAILED)
+    err("shmat");
+
+  // the last page of each is read, so mapped but clean.
+  for (i = 0; i < 3; i++)
+  {
+    a[i * PGSIZE] = 'a' + i;
+    b[i * PGSIZE] = 'b' + i;
+  }
+  s[0] = 's';
+  if (a[PGSIZE * 3] != 0 || b[PGSIZE * 3] != 0 || s[PGSIZE] != 0)
+    err("not zero");
+
+  if ((pid = fork()) < 0)
+    err("fork");
+  if (pid == 0)
+  {
+    // touch more memory than there is; the kernel may kill us.
+    for (i = 0; i < HOGMB; i++)
+    {
+      char *m = sbrk(1024 * 1024);
+      if (m == (char *)-1)
+        break;
+      for (int k = 0; k < 1024 * 1024; k += PGSIZE)
+        m[k] = 1;
+    }
+    exit(0);
+  }
+  wait(&status);
+
+  for (i = 0; i < 3; i++)
+  {
+    if (a[i * PGSIZE] != 'a' + i)
+      err("private anonymous page lost");
+    if (b[i * PGSIZE] != 'b' + i)
+      err("shared anonymous page lost");
+  }
+  if (s[0] != 's')
+    err("segment page lost");
+  if (a[PGSIZE * 3] != 0 || b[PGSIZE * 3] != 0 || s[PGSIZE] != 0)
+    err("clean page not zero");
+
+  munmap(a, PGSIZE * 4);
+  munmap(b, PGSIZE * 4);
+  shmdt(s);
+
+  printf("reclaim_test OK\n");
+}
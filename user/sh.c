@@ -3,6 +3,7 @@
 #include "kernel/types.h"
 #include "user/user.h"
 #include "kernel/fcntl.h"
+#include "kernel/spawn.h"
 
 // Parsed command representation
 #define EXEC  1
@@ -53,6 +54,9 @@ int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
 void runcmd(struct cmd*) __attribute__((noreturn));
+int spawnable(char*);
+int spawnpipe(struct cmd*, int);
+void freecmd(struct cmd*);
 
 // Execute cmd.  Never returns.
 void
@@ -131,6 +135,77 @@ runcmd(struct cmd *cmd)
   exit(0);
 }
 
+// Start the simple command cmd, with its redirections, in a
+// new process made by spawn(). Its stdin comes from fd in and
+// its stdout goes to fd out, unless they are -1, and fd other
+// is closed in it. The shell's in and out are closed.
+// Returns 1 if the command started, 0 if not.
+int
+spawn1(struct cmd *cmd, int in, int out, int other)
+{
+  struct spawnact act[SPAWN_MAXACT];
+  struct redircmd *rcmd;
+  struct execcmd *ecmd;
+  int n = 0, pid;
+
+  memset(act, 0, sizeof(act));
+  if(in >= 0){
+    act[n].type = SPAWN_DUP2;
+    act[n].fd = 0;
+    act[n++].srcfd = in;
+    act[n].type = SPAWN_CLOSE;
+    act[n++].fd = in;
+  }
+  if(out >= 0){
+    act[n].type = SPAWN_DUP2;
+    act[n].fd = 1;
+    act[n++].srcfd = out;
+    act[n].type = SPAWN_CLOSE;
+    act[n++].fd = out;
+  }
+  if(other >= 0){
+    act[n].type = SPAWN_CLOSE;
+    act[n++].fd = other;
+  }
+  // outermost redirection first, as runcmd() applies them.
+  while(cmd->type == REDIR){
+    rcmd = (struct redircmd*)cmd;
+    act[n].type = SPAWN_OPEN;
+    act[n].fd = rcmd->fd;
+    act[n].omode = rcmd->mode;
+    act[n++].path = rcmd->file;
+    cmd = rcmd->cmd;
+  }
+  ecmd = (struct execcmd*)cmd;
+
+  pid = spawn(ecmd->argv[0], ecmd->argv, act);
+  if(pid < 0)
+    fprintf(2, "exec %s failed\n", ecmd->argv[0]);
+  if(in >= 0)
+    close(in);
+  if(out >= 0)
+    close(out);
+  return pid >= 0;
+}
+
+// Start cmd, a pipeline of simple commands, the first of
+// which reads from fd in unless it is -1.
+// Returns the number of commands started.
+int
+spawnpipe(struct cmd *cmd, int in)
+{
+  struct pipecmd *pcmd;
+  int p[2], n;
+
+  if(cmd->type != PIPE)
+    return spawn1(cmd, in, -1, -1);
+  pcmd = (struct pipecmd*)cmd;
+  if(pipe(p) < 0)
+    panic("pipe");
+  n = spawn1(pcmd->left, in, p[1], p[0]);
+  return n + spawnpipe(pcmd->right, p[0]);
+}
+
 int
 getcmd(char *buf, int nbuf)
 {
@@ -146,7 +221,8 @@ int
 main(void)
 {
   static char buf[100];
-  int fd;
+  struct cmd *cmd;
+  int fd, n;
 
   // Ensure that three file descriptors are open.
   while((fd = open("console", O_RDWR)) >= 0){
@@ -165,6 +241,14 @@ main(void)
         fprintf(2, "cannot cd %s\n", buf+3);
       continue;
     }
+    if(spawnable(buf)){
+      // no need to copy the shell just to exec the command.
+      cmd = parsecmd(buf);
+      for(n = spawnpipe(cmd, -1); n > 0; n--)
+        wait(0);
+      freecmd(cmd);
+      continue;
+    }
     if(fork1() == 0)
       runcmd(parsecmd(buf));
     wait(0);
@@ -320,6 +404,41 @@ peek(char **ps, char *es, char *toks)
   return *s && strchr(toks, *s);
 }
 
+// Return 1 if the line s is a simple command or a pipeline
+// of them, with at most two redirections each, which main()
+// runs with spawn(). Such a line always parses without error.
+int
+spawnable(char *s)
+{
+  char *es = s + strlen(s);
+  int tok, words = 0, redirs = 0;
+
+  for(;;){
+    switch(tok = gettoken(&s, es, 0, 0)){
+    case 'a':
+      if(++words >= MAXARGS)
+        return 0;
+      break;
+    case '<':
+    case '>':
+    case '+':
+      if(++redirs > 2 || gettoken(&s, es, 0, 0) != 'a')
+        return 0;
+      break;
+    case '|':
+    case 0:
+      if(words == 0)
+        return 0;
+      if(tok == 0)
+        return 1;
+      words = redirs = 0;
+      break;
+    default:
+      return 0;
+    }
+  }
+}
+
 struct cmd *parseline(char**, char*);
 struct cmd *parsepipe(char**, char*);
 struct cmd *parseexec(char**, char*);
@@ -492,3 +611,29 @@ nulterminate(struct cmd *cmd)
   }
   return cmd;
 }
+
+// Free a command tree made by parsecmd().
+void
+freecmd(struct cmd *cmd)
+{
+  if(cmd == 0)
+    return;
+
+  switch(cmd->type){
+  case REDIR:
+    freecmd(((struct redircmd*)cmd)->cmd);
+    break;
+
+  case PIPE:
+  case LIST:
+    // struct pipecmd and struct listcmd have the same layout.
+    freecmd(((struct pipecmd*)cmd)->left);
+    freecmd(((struct pipecmd*)cmd)->right);
+    break;
+
+  case BACK:
+    freecmd(((struct backcmd*)cmd)->cmd);
+    break;
+  }
+  free(cmd);
+}
@@ -2,9 +2,17 @@
 #include "kernel/stat.h"
 #include "user/user.h"
 #include "kernel/param.h"
+#include "kernel/fcntl.h"
+#include "kernel/riscv.h"
 
 // Memory allocator by Kernighan and Ritchie,
 // The C programming Language, 2nd ed.  Section 8.7.
+//
+// Blocks of MMAPMIN bytes or more get their own anonymous
+// mapping instead, which free() gives back with munmap(),
+// so that they do not grow the break for good.
+
+#define MMAPMIN (16*PGSIZE)
 
 typedef long Align;
 
@@ -20,6 +28,7 @@ typedef union header Header;
 
 static Header base;
 static Header *freep;
+static Header mapped;   // s.ptr of a block with its own mapping
 
 void
 free(void *ap)
@@ -27,6 +36,10 @@ free(void *ap)
   Header *bp, *p;
 
   bp = (Header*)ap - 1;
+  if(bp->s.ptr == &mapped){
+    munmap(bp, bp->s.size * sizeof(Header));
+    return;
+  }
   for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
     if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
       break;
@@ -56,6 +69,7 @@ morecore(uint nu)
     return 0;
   hp = (Header*)p;
   hp->s.size = nu;
+  hp->s.ptr = 0;
   free((void*)(hp + 1));
   return freep;
 }
@@ -66,6 +80,16 @@ malloc(uint nbytes)
   Header *p, *prevp;
   uint nunits;
 
+  if(nbytes >= MMAPMIN){
+    nunits = PGROUNDUP(nbytes + sizeof(Header)) / sizeof(Header);
+    p = mmap(0, nunits * sizeof(Header), PROT_RW, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == (Header*)MAP_FAILED)
+      return 0;
+    p->s.ptr = &mapped;
+    p->s.size = nunits;
+    return (void*)(p + 1);
+  }
+
   nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
   if((prevp = freep) == 0){
     base.s.ptr = freep = prevp = &base;
@@ -80,6 +104,7 @@ malloc(uint nbytes)
         p += p->s.size;
         p->s.size = nunits;
       }
+      p->s.ptr = 0;
       freep = prevp;
       return (void*)(p + 1);
     }
@@ -1,5 +1,7 @@
 struct stat;
 struct pstat;
+struct faultstat;
+struct spawnact;
 
 // system calls
 int fork(void);
@@ -27,7 +29,15 @@ int settickets(int);
 int getpinfo(struct pstat *);
 void* mmap(void * addr, int length, int prot, int flags, int fd, int offset);
 int munmap(void * addr, int length);
+int mprotect(void * addr, int length, int prot);
+int msync(void * addr, int length, int flags);
+int madvise(void * addr, int length, int advice);
+int shmget(int key, uint size, int flags);
+void* shmat(int id, void * addr, int flags);
+int shmdt(void * addr);
+int faultstat(int pid, struct faultstat *);
 int getpagefaults(void);
+int spawn(const char*, char**, struct spawnact*);
 
 
 // ulib.c
@@ -4,6 +4,7 @@
 #include "user/user.h"
 #include "kernel/fs.h"
 #include "kernel/fcntl.h"
+#include "kernel/spawn.h"
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
@@ -730,6 +731,48 @@ exectest(char *s)
 
 }
 
+// spawn() with a redirection, and with a program that doesn't exist.
+void
+spawntest(char *s)
+{
+  int fd, xstatus, pid;
+  char *echoargv[] = { "echo", "OK", 0 };
+  struct spawnact act[2];
+  char buf[3];
+
+  unlink("echo-ok");
+  memset(act, 0, sizeof(act));
+  act[0].type = SPAWN_OPEN;
+  act[0].fd = 1;
+  act[0].omode = O_CREATE|O_WRONLY;
+  act[0].path = "echo-ok";
+  if((pid = spawn("echo", echoargv, act)) < 0){
+    printf("%s: spawn echo failed\n", s);
+    exit(1);
+  }
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: wait failed\n", s);
+    exit(1);
+  }
+
+  fd = open("echo-ok", O_RDONLY);
+  if(fd < 0 || read(fd, buf, 2) != 2){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("echo-ok");
+  if(buf[0] != 'O' || buf[1] != 'K'){
+    printf("%s: wrong output\n", s);
+    exit(1);
+  }
+
+  if(spawn("nosuchprogram", echoargv, 0) >= 0){
+    printf("%s: spawn of a missing program succeeded\n", s);
+    exit(1);
+  }
+}
+
 // simple fork and pipe read/write
 
 void
@@ -2593,6 +2636,7 @@ struct test {
   {createtest, "createtest"},
   {dirtest, "dirtest"},
   {exectest, "exectest"},
+  {spawntest, "spawntest"},
   {pipe1, "pipe1"},
   {killstatus, "killstatus"},
   //s{preempt, "preempt"},
@@ -41,3 +41,11 @@ entry("getpinfo");
 entry("mmap");
 entry("munmap");
 entry("getpagefaults");
+entry("spawn");
+entry("mprotect");
+entry("msync");
+entry("madvise");
+entry("shmget");
+entry("shmat");
+entry("shmdt");
+entry("faultstat");